@@ -99,45 +99,33 @@ int ExecuteResourceScript(LPSTR exeFile, LPSTR iniFile, bool clear)
 	}
 
 	// Store icons
-	TCHAR key[MAX_PATH];
-	for(int i = 1; i <= 100; i++) {
-		sprintf(key, ":icon.%d", i);
-		char* iconFile = iniparser_getstr(ini, key);
-		if(iconFile) {
-			if(i == 1) {
-				if(!Resource::SetIcon(exeFile, iconFile))
-					return 1;
-			} else {
-				if(!Resource::AddIcon(exeFile, iconFile))
-					return 1;
-			}
-		} else if(i > 10) {
-			break;
+	dictionary_list* list = dictionary_getlist(ini, ":icon");
+	for(int i = 0; list != NULL && i < list->n; i++) {
+		char* iconFile = dictionary_getval(ini, list->slot[i]);
+		if(!iconFile) continue;
+		if(list->num[i] == 1) {
+			if(!Resource::SetIcon(exeFile, iconFile))
+				return 1;
+		} else {
+			if(!Resource::AddIcon(exeFile, iconFile))
+				return 1;
 		}
 	}
 
 	// Store jars
-	for(int i = 1; i <= 100; i++) {
-		sprintf(key, ":jar.%d", i);
-		char* jarFile = iniparser_getstr(ini, key);
-		if(jarFile) {
-			if(!Resource::AddJar(exeFile, jarFile))
-				return 1;
-		} else if(i > 10) {
-			break;
-		}
+	list = dictionary_getlist(ini, ":jar");
+	for(int i = 0; list != NULL && i < list->n; i++) {
+		char* jarFile = dictionary_getval(ini, list->slot[i]);
+		if(jarFile && !Resource::AddJar(exeFile, jarFile))
+			return 1;
 	}
 
 	// Store HTML
-	for(int i = 1; i <= 100; i++) {
-		sprintf(key, ":html.%d", i);
-		char* htmlFile = iniparser_getstr(ini, key);
-		if(htmlFile) {
-			if(!Resource::AddHTML(exeFile, htmlFile))
-				return 1;
-		} else if(i > 10) {
-			break;
-		}
+	list = dictionary_getlist(ini, ":html");
+	for(int i = 0; list != NULL && i < list->n; i++) {
+		char* htmlFile = dictionary_getval(ini, list->slot[i]);
+		if(htmlFile && !Resource::AddHTML(exeFile, htmlFile))
+			return 1;
 	}
 
 	// Check for version information (we require version.fileversion)
@@ -15,6 +15,7 @@
 #include "launcher/Service.h"
 #include "launcher/EventLog.h"
 #include "launcher/Native.h"
+#include "launcher/Placement.h"
 #include "common/Registry.h"
 
 #define CONSOLE_TITLE                       ":console.title"
@@ -28,9 +29,14 @@
 #define ERROR_MESSAGES_JAVA_START_FAILED    "ErrorMessages:java.failed"
 #define ERROR_MESSAGES_MAIN_CLASS_NOT_FOUND "ErrorMessages:main.class.not.found"
 
+// Room for the VM args the launcher adds to the vmarg.N list itself, and the
+// NULL that ends the list. Each module that adds args says how many.
+#define VM_ARGS_RESERVE (VM_LIBRARY_PATH_MAX_ARGS + CLASS_PATH_MAX_ARGS + \
+	VM_SPECIFIC_MAX_ARGS + PLACEMENT_MAX_ARGS + CDS_MAX_ARGS + 1)
+
 namespace 
 {
-	TCHAR *vmargs[MAX_PATH];
+	TCHAR **vmargs = NULL;
 	UINT vmargsCount = 0;
 	TCHAR *progargs[MAX_PATH];
 	UINT progargsCount = 0;
@@ -127,8 +133,11 @@ int WinRun4J::DoBuiltInCommand(HINSTANCE hInstance)
 		dictionary* ini = INI::LoadIniFile(hInstance);
 		if(ini == NULL) 
 			return 1;
-		for(int i = 0; i < ini->n; i++) 
-			printf("%s=%s\n", ini->key[i], ini->val[i]);
+		// Print every value fully expanded rather than as read so far
+		INI::ExpandAll(ini);
+		for(int i = 0; i < ini->last; i++) 
+			if(ini->key[i])
+				printf("%s=%s\n", ini->key[i], ini->val[i]);
 		return 0;
 	}
 
@@ -142,6 +151,17 @@ int WinRun4J::DoBuiltInCommand(HINSTANCE hInstance)
 		return WinRun4J::ExecuteINI(hInstance, ini);
 	}
 
+	// Launch repeatedly and report where startup time goes
+	if(StartsWith(lpArg1, "--WinRun4J:StartupProfile")) {
+		int runs = 10;
+		UINT first = 1;
+		if(progargsCount > 1 && progargs[1][0] >= '0' && progargs[1][0] <= '9') {
+			runs = atoi(progargs[1]);
+			first = 2;
+		}
+		return Profile::Run(runs, &progargs[first], progargsCount > first ? progargsCount - first : 0);
+	}
+
 	if(StartsWith(lpArg1, "--WinRun4J:Version")) {
 		Log::Info("0.4.5\n");
 		return 0;
@@ -169,7 +189,9 @@ int WinRun4J::StartVM(dictionary* ini)
 	bool showErrorPopup = iniparser_getboolean(ini, ERROR_MESSAGES_SHOW_POPUP, 1);
 
 	// Attempt to find an appropriate java VM
+	LONGLONG start = Profile::Start();
 	char* vmlibrary = VM::FindJavaVMLibrary(ini);
+	Profile::End(PROFILE_VM_FIND, start);
 	if(!vmlibrary) {
 		char* javaNotFound = iniparser_getstring(ini, ERROR_MESSAGES_JAVA_NOT_FOUND, "Failed to find Java VM.");
 		Log::Error(javaNotFound);
@@ -181,14 +203,39 @@ int WinRun4J::StartVM(dictionary* ini)
 
 	Log::Info("Found VM: %s", vmlibrary);
 
+	// Read the VM files ahead of the VM, the classpath is added once built
+	Prefetch::Start(ini, vmlibrary);
+
 	// Collect the VM args from the INI file
-	INI::GetNumberedKeysFromIni(ini, VM_ARG, vmargs, vmargsCount);
+	vmargs = INI::GetNumberedKeysFromIni(ini, VM_ARG, vmargsCount, VM_ARGS_RESERVE);
+
+	// The library's dependencies are looked up on the PATH, so extend it
+	// before the load starts
+	VM::SetLibraryPath(ini, vmargs, vmargsCount);
+
+	// Nothing below changes which library is loaded, so load it while the
+	// classpath and VM args are assembled
+	VM::PreloadJavaVM(ini, vmlibrary);
 
 	// Build up the classpath and add to vm args
+	start = Profile::Start();
 	Classpath::BuildClassPath(ini, vmargs, vmargsCount);
+	Profile::End(PROFILE_CLASSPATH, start);
+	Prefetch::AddClasspath(vmargs, vmargsCount);
 
 	// Extract the specific VM args
-	VM::ExtractSpecificVMArgs(ini, vmargs, vmargsCount);
+	if(!VM::ExtractSpecificVMArgs(ini, vmargs, vmargsCount)) {
+		char* javaFailed = iniparser_getstring(ini, ERROR_MESSAGES_JAVA_START_FAILED, "Error starting Java VM.");
+		Log::Error(javaFailed);
+		if(showErrorPopup)
+			MessageBox(NULL, javaFailed, "Startup Error", 0);
+		Log::Close();
+		return 1;
+	}
+	Placement::AddArgs(vmargs, vmargsCount);
+
+	// Use (or create) a class data sharing archive for this classpath
+	CDS::AddArgs(ini, vmlibrary, vmargs, vmargsCount);
 
 	// Log the VM args
 	if(vmargsCount > 0)
@@ -202,6 +249,9 @@ int WinRun4J::StartVM(dictionary* ini)
 	// Make sure there is a NULL at the end of the args
 	vmargs[vmargsCount] = NULL;
 
+	// Publish the INI for JNI and native callers before the VM can start other threads
+	INI::Publish(ini);
+
 	// Start the VM
 	if(VM::StartJavaVM(vmlibrary, vmargs, NULL) != 0) {
 		char* javaFailed = iniparser_getstring(ini, ERROR_MESSAGES_JAVA_START_FAILED, "Error starting Java VM.");
@@ -212,6 +262,8 @@ int WinRun4J::StartVM(dictionary* ini)
 		return 1;
 	}
 
+	Prefetch::Report();
+
 	return 0;
 }
 
@@ -221,6 +273,8 @@ void WinRun4J::FreeArgs()
 	for(UINT i = 0; i < vmargsCount; i++) {
 		free(vmargs[i]);
 	}
+	free(vmargs);
+	vmargs = NULL;
 
 	// Free program args
 	for(UINT i = 0; i < progargsCount; i++) {
@@ -299,6 +353,9 @@ int WinRun4J::ExecuteINI(HINSTANCE hInstance, dictionary* ini)
 	// Check for process priority setting
 	WinRun4J::SetProcessPriority(ini);
 
+	// Pin to processors or a NUMA node before any VM thread exists
+	Placement::Apply(ini);
+
 	// Start vm
 	int result = WinRun4J::StartVM(ini);
 	if(result) {
@@ -321,15 +378,17 @@ int WinRun4J::ExecuteINI(HINSTANCE hInstance, dictionary* ini)
 #endif 
 
 	// Pull out the command line args (plus any existing INI args)
-	TCHAR *argv[MAX_PATH];
 	UINT argc = 0;
-	INI::GetNumberedKeysFromIni(ini, ":arg", argv, argc);
+	TCHAR** argv = INI::GetNumberedKeysFromIni(ini, PROG_ARG, argc);
 
-	// Run the main class (or service class)
-	if(serviceMode)
-		result = Service::Run(hInstance, ini, argc, argv);
-	else
+	// Run the main class (or service class). The startup profile is reported
+	// once the main class is found, or here before a service is run.
+	if(serviceMode) {
+		if(!Profile::Report(ini))
+			result = Service::Run(hInstance, ini, argc, argv);
+	} else {
 		result = JNI::RunMainClass(env, mainCls, argc, argv);
+	}
 	
 	// Check for exception - if not a service
 	if(serviceCls == NULL)
@@ -363,11 +422,15 @@ int __stdcall WinMain(HINSTANCE hInstance, HINSTANCE /*hPrevInstance*/, LPSTR lp
 	lpCmdLine = StripArg0(GetCommandLine());
 #endif
 
+	Profile::Init();
+
 	// Initialise the logger using std streams
 	Log::Init(hInstance, NULL, NULL, NULL);
 
 	// Parse cmd line so we can check for built ins and overrides
+	LONGLONG start = Profile::Start();
 	ParseCommandLine(lpCmdLine, progargs, progargsCount, true);
+	Profile::End(PROFILE_COMMAND_LINE, start);
 
 	// Check for Builtin commands
 	if(progargsCount && strncmp(progargs[0], "--WinRun4J:", 11) == 0) {
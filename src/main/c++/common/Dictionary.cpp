@@ -14,37 +14,373 @@ iniparser is distributed under an MIT license.
 
 #define MAXVALSZ	1024
 #define DICTMINSZ	128
+#define ARENABLKSZ	16384
 #define DICT_INVALID_KEY    ((char*)-1)
 
-static void * mem_double(void * ptr, int size)
+#define INDEX_EMPTY		(-1)
+#define INDEX_DELETED	(-2)
+#define SECMINSZ		8
+#define LISTMINSZ		16
+
+static void * mem_grow(void * ptr, int size, int newsize)
 {
     void    *   newptr ;
  
-    newptr = calloc(2*size, 1);
+    newptr = calloc(newsize, 1);
     memcpy(newptr, ptr, size);
     free(ptr);
     return newptr ;
 }
 
-unsigned dictionary_hash(char * key)
+unsigned dictionary_hash(const char * key)
+{
+	return dictionary_hashn(key, strlen(key));
+}
+
+/* Private: feed len chars into a running one-at-a-time hash */
+static unsigned hash_step(unsigned hash, const char * key, int len)
 {
-	int			len ;
-	unsigned	hash ;
 	int			i ;
 
-	len = strlen(key);
-	for (hash=0, i=0 ; i<len ; i++) {
+	for (i=0 ; i<len ; i++) {
 		hash += (unsigned)key[i] ;
 		hash += (hash<<10);
 		hash ^= (hash>>6) ;
 	}
+	return hash ;
+}
+
+/* Private: finish a running hash */
+static unsigned hash_final(unsigned hash)
+{
 	hash += (hash <<3);
 	hash ^= (hash >>11);
 	hash += (hash <<15);
 	return hash ;
 }
 
-dictionary * dictionary_new(int size)
+unsigned dictionary_hashn(const char * key, int len)
+{
+	return hash_final(hash_step(0, key, len));
+}
+
+/* Private: bump allocate len bytes from the dictionary arena */
+static char * arena_alloc(dictionary * d, int len)
+{
+	dictionary_block *	b ;
+	char *				p ;
+	int					size ;
+
+	b = d->blocks ;
+	if (b==NULL || b->size - b->used < len) {
+		/* Large strings get a block of their own so the current block keeps filling */
+		size = len > ARENABLKSZ/4 ? len : ARENABLKSZ ;
+		b = (dictionary_block *)malloc(sizeof(dictionary_block) + size);
+		b->size = size ;
+		b->used = 0 ;
+		if (size==len && d->blocks!=NULL) {
+			b->next = d->blocks->next ;
+			d->blocks->next = b ;
+		} else {
+			b->next = d->blocks ;
+			d->blocks = b ;
+		}
+	}
+	p = (char *)(b+1) + b->used ;
+	b->used += len ;
+	return p ;
+}
+
+/* Private: copy len chars of a string into dictionary owned storage */
+static char * dictionary_strndup(dictionary * d, const char * s, int len)
+{
+	char *	p ;
+
+	p = d->arena ? arena_alloc(d, len+1) : (char *)malloc(len+1);
+	memcpy(p, s, len);
+	p[len] = 0 ;
+	return p ;
+}
+
+/* Private: release a string copied by dictionary_strndup */
+static void dictionary_strfree(dictionary * d, char * s)
+{
+	/* Arena strings are released all at once in dictionary_del */
+	if (s!=NULL && !d->arena)
+		free(s);
+}
+
+static int dictionary_put(dictionary * d, const char * key, int keylen, unsigned hash, const char * val, int vallen, int copy);
+static void dictionary_reserve(dictionary * d, int n);
+
+/* Private: find or create the section a key belongs to */
+static int dictionary_section_for(dictionary * d, const char * key, int keylen)
+{
+	const char *		colon ;
+	int					len ;
+	unsigned			hash ;
+	int					i ;
+	dictionary_section *	s ;
+
+	colon = (const char *)memchr(key, ':', keylen);
+	len = colon ? (int)(colon-key) : keylen ;
+
+	/* Keys arrive grouped by section so the last section used nearly always matches */
+	s = d->seccur<d->nsec ? &d->sec[d->seccur] : NULL ;
+	if (s!=NULL && s->len==len && !strncmp(s->name, key, len))
+		return d->seccur ;
+
+	hash = dictionary_hashn(key, len);
+	for (i=0 ; i<d->nsec ; i++) {
+		s = &d->sec[i] ;
+		if (s->hash==hash && s->len==len && !strncmp(s->name, key, len))
+			return d->seccur = i ;
+	}
+
+	if (d->nsec==d->secsize) {
+		d->secsize = d->secsize ? 2*d->secsize : SECMINSZ ;
+		d->sec = (dictionary_section *)realloc(d->sec, d->secsize * sizeof(dictionary_section));
+	}
+	s = &d->sec[d->nsec] ;
+	s->name  = dictionary_strndup(d, key, len);
+	s->len   = len ;
+	s->hash  = hash ;
+	s->slot  = -1 ;
+	s->first = -1 ;
+	s->last  = -1 ;
+	return d->seccur = d->nsec++ ;
+}
+
+/* Private: append a slot to the end of its section */
+static void dictionary_section_link(dictionary * d, int slot, int id)
+{
+	dictionary_section *	s ;
+
+	s = &d->sec[id] ;
+	d->secid[slot] = id ;
+	d->snext[slot] = -1 ;
+	d->sprev[slot] = s->last ;
+	if (s->last<0)
+		s->first = slot ;
+	else
+		d->snext[s->last] = slot ;
+	s->last = slot ;
+}
+
+/* Private: remove a slot from its section */
+static void dictionary_section_unlink(dictionary * d, int slot)
+{
+	dictionary_section *	s ;
+
+	s = &d->sec[d->secid[slot]] ;
+	if (d->sprev[slot]<0)
+		s->first = d->snext[slot] ;
+	else
+		d->snext[d->sprev[slot]] = d->snext[slot] ;
+	if (d->snext[slot]<0)
+		s->last = d->sprev[slot] ;
+	else
+		d->sprev[d->snext[slot]] = d->sprev[slot] ;
+	if (s->slot==slot)
+		s->slot = -1 ;
+}
+
+/* Private: split a name.N key, returning the length of name (or -1) */
+static int dictionary_listkey(const char * key, int keylen, int * num)
+{
+	int		i ;
+	int		start ;
+	int		n ;
+
+	for (start=keylen ; start>0 && isdigit((unsigned char)key[start-1]) ; start--) ;
+	/* Entries are numbered from 1 without leading zeros */
+	if (start==keylen || start<2 || key[start-1]!='.' || key[start]=='0' || keylen-start>9)
+		return -1 ;
+	for (n=0, i=start ; i<keylen ; i++)
+		n = n*10 + (key[i]-'0') ;
+	*num = n ;
+	return start-1 ;
+}
+
+/* Private: find a list by name, optionally creating it */
+static dictionary_list * dictionary_findlist(dictionary * d, const char * name, int len, bool create)
+{
+	unsigned			hash ;
+	int					pos ;
+	int					mask ;
+	int					i ;
+	dictionary_list	*	l ;
+
+	hash = dictionary_hashn(name, len);
+	if (d->lisize>0) {
+		mask = d->lisize - 1 ;
+		for (pos=hash & mask ; (i=d->lindex[pos])>=0 ; pos=(pos+1) & mask) {
+			l = &d->list[i] ;
+			if (l->hash==hash && l->len==len && !strncmp(l->name, name, len))
+				return l ;
+		}
+	}
+	if (!create)
+		return NULL ;
+
+	if (d->nlist==d->listsize) {
+		d->listsize = d->listsize ? 2*d->listsize : LISTMINSZ ;
+		d->list = (dictionary_list *)realloc(d->list, d->listsize * sizeof(dictionary_list));
+		/* Grow the index with the list storage */
+		free(d->lindex);
+		d->lisize = 2*d->listsize ;
+		d->lindex = (int *)malloc(d->lisize * sizeof(int));
+		memset(d->lindex, 0xff, d->lisize * sizeof(int));
+		mask = d->lisize - 1 ;
+		for (i=0 ; i<d->nlist ; i++) {
+			for (pos=d->list[i].hash & mask ; d->lindex[pos]>=0 ; pos=(pos+1) & mask) ;
+			d->lindex[pos] = i ;
+		}
+	}
+	mask = d->lisize - 1 ;
+	for (pos=hash & mask ; d->lindex[pos]>=0 ; pos=(pos+1) & mask) ;
+	d->lindex[pos] = d->nlist ;
+
+	l = &d->list[d->nlist++] ;
+	l->name = dictionary_strndup(d, name, len);
+	l->len  = len ;
+	l->hash = hash ;
+	l->n    = 0 ;
+	l->size = 0 ;
+	l->num  = NULL ;
+	l->slot = NULL ;
+	return l ;
+}
+
+/* Private: binary search a list for an entry number */
+static int dictionary_listpos(dictionary_list * l, int num)
+{
+	int		lo, hi, mid ;
+
+	lo = 0 ;
+	hi = l->n ;
+	while (lo<hi) {
+		mid = (lo+hi)/2 ;
+		if (l->num[mid]<num)
+			lo = mid+1 ;
+		else
+			hi = mid ;
+	}
+	return lo ;
+}
+
+/* Private: add a new slot to its numbered key list (if it is a name.N key) */
+static void dictionary_list_add(dictionary * d, const char * key, int keylen, int slot)
+{
+	dictionary_list	*	l ;
+	int					len ;
+	int					num ;
+	int					pos ;
+
+	if ((len=dictionary_listkey(key, keylen, &num))<0)
+		return ;
+	l = dictionary_findlist(d, key, len, true);
+	if (l->n==l->size) {
+		l->size = l->size ? 2*l->size : LISTMINSZ ;
+		l->num  = (int *)realloc(l->num, l->size * sizeof(int));
+		l->slot = (int *)realloc(l->slot, l->size * sizeof(int));
+	}
+	/* Entries normally arrive in order so this is an append */
+	pos = (l->n==0 || l->num[l->n-1]<num) ? l->n : dictionary_listpos(l, num) ;
+	memmove(&l->num[pos+1], &l->num[pos], (l->n-pos) * sizeof(int));
+	memmove(&l->slot[pos+1], &l->slot[pos], (l->n-pos) * sizeof(int));
+	l->num[pos]  = num ;
+	l->slot[pos] = slot ;
+	l->n++ ;
+}
+
+/* Private: remove a slot from its numbered key list */
+static void dictionary_list_remove(dictionary * d, const char * key)
+{
+	dictionary_list	*	l ;
+	int					len ;
+	int					num ;
+	int					pos ;
+
+	if ((len=dictionary_listkey(key, strlen(key), &num))<0)
+		return ;
+	if ((l=dictionary_findlist(d, key, len, false))==NULL)
+		return ;
+	pos = dictionary_listpos(l, num);
+	if (pos<l->n && l->num[pos]==num) {
+		l->n-- ;
+		memmove(&l->num[pos], &l->num[pos+1], (l->n-pos) * sizeof(int));
+		memmove(&l->slot[pos], &l->slot[pos+1], (l->n-pos) * sizeof(int));
+	}
+}
+
+/* Private: rebuild the hash index from the slot arrays (drops deleted markers) */
+static void dictionary_reindex(dictionary * d)
+{
+	int		i ;
+	int		pos ;
+	int		mask ;
+
+	mask = d->isize - 1 ;
+	memset(d->index, 0xff, d->isize * sizeof(int));
+	for (i=0 ; i<d->last ; i++) {
+		if (d->key[i]==NULL)
+			continue ;
+		pos = d->hash[i] & mask ;
+		while (d->index[pos]!=INDEX_EMPTY)
+			pos = (pos+1) & mask ;
+		d->index[pos] = i ;
+	}
+}
+
+/* Private: close up the holes left by unset so that slots [0,n) are in use */
+static void dictionary_compact(dictionary * d)
+{
+	int		i, j ;
+	int	*	remap ;
+
+	remap = (int *)malloc(d->last * sizeof(int));
+	for (i=0, j=0 ; i<d->last ; i++) {
+		if (d->key[i]==NULL)
+			continue ;
+		remap[i] = j ;
+		if (i!=j) {
+			d->key[j]  = d->key[i] ;
+			d->val[j]  = d->val[i] ;
+			d->hash[j] = d->hash[i] ;
+			d->secid[j] = d->secid[i] ;
+			d->flags[j] = d->flags[i] ;
+			d->flags[i] = 0 ;
+			d->typed[j] = d->typed[i] ;
+			d->typed[i].have = 0 ;
+			d->key[i]  = NULL ;
+			d->val[i]  = NULL ;
+			d->hash[i] = 0 ;
+		}
+		j++ ;
+	}
+	d->last = j ;
+
+	/* Slots have moved so relink the sections */
+	for (i=0 ; i<d->nsec ; i++) {
+		d->sec[i].first = d->sec[i].last = -1 ;
+		d->sec[i].slot = -1 ;
+	}
+	for (i=0 ; i<d->last ; i++) {
+		dictionary_section_link(d, i, d->secid[i]);
+		if (strchr(d->key[i], ':')==NULL)
+			d->sec[d->secid[i]].slot = i ;
+	}
+
+	/* ...and renumber the list entries */
+	for (i=0 ; i<d->nlist ; i++) {
+		for (j=0 ; j<d->list[i].n ; j++)
+			d->list[i].slot[j] = remap[d->list[i].slot[j]] ;
+	}
+	free(remap);
+}
+
+dictionary * dictionary_new(int size, bool arena)
 {
 	dictionary	*	d ;
 
@@ -56,45 +392,188 @@ dictionary * dictionary_new(int size)
 	d->val  = (char **)calloc(size, sizeof(char*));
 	d->key  = (char **)calloc(size, sizeof(char*));
 	d->hash = (unsigned int *)calloc(size, sizeof(unsigned));
+	d->secid = (int *)calloc(size, sizeof(int));
+	d->snext = (int *)calloc(size, sizeof(int));
+	d->sprev = (int *)calloc(size, sizeof(int));
+	d->flags = (unsigned char *)calloc(size, 1);
+	d->typed = (dictionary_value *)calloc(size, sizeof(dictionary_value));
+	d->arena = arena ;
+
+	/* Index is kept at least twice the storage size so probes stay short */
+	for (d->isize=DICTMINSZ ; d->isize<2*size ; d->isize*=2) ;
+	d->index = (int *)malloc(d->isize * sizeof(int));
+	memset(d->index, 0xff, d->isize * sizeof(int));
 	return d ;
 }
 
 void dictionary_del(dictionary * d)
 {
-	int		i ;
+	int					i ;
+	dictionary_block *	b ;
 
 	if (d==NULL) return ;
-	for (i=0 ; i<d->size ; i++) {
-		if (d->key[i]!=NULL)
-			free(d->key[i]);
-		if (d->val[i]!=NULL)
-			free(d->val[i]);
+	if (d->expand!=NULL)
+		d->expand(d, -1);
+	if (d->arena) {
+		while ((b=d->blocks)!=NULL) {
+			d->blocks = b->next ;
+			free(b);
+		}
+	} else {
+		for (i=0 ; i<d->last ; i++) {
+			if (d->key[i]!=NULL)
+				free(d->key[i]);
+			if (d->val[i]!=NULL)
+				free(d->val[i]);
+		}
+		for (i=0 ; i<d->nsec ; i++)
+			free(d->sec[i].name);
+		for (i=0 ; i<d->nlist ; i++)
+			free(d->list[i].name);
+	}
+	for (i=0 ; i<d->nlist ; i++) {
+		free(d->list[i].num);
+		free(d->list[i].slot);
 	}
+	free(d->list);
+	free(d->lindex);
 	free(d->val);
 	free(d->key);
 	free(d->hash);
+	free(d->index);
+	free(d->secid);
+	free(d->snext);
+	free(d->sprev);
+	free(d->flags);
+	free(d->typed);
+	free(d->sec);
 	free(d);
 	return ;
 }
 
-char * dictionary_get(dictionary * d, char * key, char * def)
+int dictionary_lookup(dictionary * d, const char * key, int len, unsigned hash)
 {
+	int		pos ;
+	int		mask ;
+	int		slot ;
+
+	mask = d->isize - 1 ;
+	for (pos=hash & mask ; (slot=d->index[pos])!=INDEX_EMPTY ; pos=(pos+1) & mask) {
+		if (slot==INDEX_DELETED)
+			continue ;
+		/* Compare hash, then string to avoid hash collisions */
+		if (hash==d->hash[slot] && !strncmp(key, d->key[slot], len) && d->key[slot][len]==0)
+			return slot ;
+	}
+	return -1 ;
+}
+
+int dictionary_lookupsec(dictionary * d, const char * sec, const char * key)
+{
+	int			seclen ;
+	int			keylen ;
 	unsigned	hash ;
-	int			i ;
+	int			pos ;
+	int			mask ;
+	int			slot ;
+	char	*	k ;
+
+	/* Same as looking up sec followed by key, without building the string */
+	seclen = strlen(sec);
+	keylen = strlen(key);
+	hash = hash_final(hash_step(hash_step(0, sec, seclen), key, keylen));
+	mask = d->isize - 1 ;
+	for (pos=hash & mask ; (slot=d->index[pos])!=INDEX_EMPTY ; pos=(pos+1) & mask) {
+		if (slot==INDEX_DELETED || hash!=d->hash[slot])
+			continue ;
+		k = d->key[slot] ;
+		if (!strncmp(sec, k, seclen) && !strncmp(key, k+seclen, keylen) && k[seclen+keylen]==0)
+			return slot ;
+	}
+	return -1 ;
+}
 
-	hash = dictionary_hash(key);
-	for (i=0 ; i<d->size ; i++) {
-        if (d->key==NULL)
-            continue ;
-        /* Compare hash */
-		if (hash==d->hash[i]) {
-            /* Compare string, to avoid hash collisions */
-            if (!strcmp(key, d->key[i])) {
-				return d->val[i] ;
-			}
-		}
+dictionary_list * dictionary_getlist(dictionary * d, const char * key)
+{
+	dictionary_list	*	l ;
+
+	if (d==NULL || key==NULL) return NULL ;
+	l = dictionary_findlist(d, key, strlen(key), false);
+	return (l==NULL || l->n==0) ? NULL : l ;
+}
+
+char * dictionary_getval(dictionary * d, int slot)
+{
+	/* Values still holding variables are expanded on first read */
+	if ((d->flags[slot] & DICT_EXPAND) && d->expand!=NULL)
+		return d->expand(d, slot);
+	return d->val[slot] ;
+}
+
+/*
+ * Typed reads parse the value once and keep the result next to it. The field
+ * is written before its bit is published so concurrent readers of a shared
+ * (read-only) dictionary only ever see a complete value.
+ */
+int dictionary_getvalint(dictionary * d, int slot)
+{
+	dictionary_value *	t ;
+	char			 *	v ;
+
+	t = &d->typed[slot] ;
+	if (t->have & DICT_INT)
+		return t->i ;
+	v = dictionary_getval(d, slot);
+	t->i = v ? (int)strtol(v, NULL, 0) : 0 ;
+	InterlockedOr(&t->have, DICT_INT);
+	return t->i ;
+}
+
+double dictionary_getvaldouble(dictionary * d, int slot)
+{
+	dictionary_value *	t ;
+	char			 *	v ;
+
+	t = &d->typed[slot] ;
+	if (t->have & DICT_DOUBLE)
+		return t->f ;
+	v = dictionary_getval(d, slot);
+	t->f = v ? atof(v) : 0 ;
+	InterlockedOr(&t->have, DICT_DOUBLE);
+	return t->f ;
+}
+
+int dictionary_getvalbool(dictionary * d, int slot)
+{
+	dictionary_value *	t ;
+	char			 *	v ;
+
+	t = &d->typed[slot] ;
+	if (t->have & DICT_BOOL)
+		return t->b ;
+	v = dictionary_getval(d, slot);
+	switch (v ? v[0] : 0) {
+	case 'y': case 'Y': case '1': case 't': case 'T':
+		t->b = 1 ;
+		break ;
+	case 'n': case 'N': case '0': case 'f': case 'F':
+		t->b = 0 ;
+		break ;
+	default:
+		t->b = -1 ;
 	}
-	return def ;
+	InterlockedOr(&t->have, DICT_BOOL);
+	return t->b ;
+}
+
+char * dictionary_get(dictionary * d, char * key, char * def)
+{
+	int		slot ;
+	int		len ;
+
+	len = strlen(key);
+	slot = dictionary_lookup(d, key, len, dictionary_hashn(key, len));
+	return slot<0 ? def : dictionary_getval(d, slot) ;
 }
 
 char dictionary_getchar(dictionary * d, char * key, char def)
@@ -132,89 +611,201 @@ double dictionary_getdouble(dictionary * d, char * key, double def)
 
 void dictionary_set(dictionary * d, char * key, char * val)
 {
-	int			i ;
-	unsigned	hash ;
+	if (d==NULL || key==NULL) return ;
+	dictionary_setn(d, key, strlen(key), val, val ? strlen(val) : 0);
+}
 
+void dictionary_setn(dictionary * d, const char * key, int keylen, const char * val, int vallen)
+{
 	if (d==NULL || key==NULL) return ;
-	
-	/* Compute hash for this key */
-	hash = dictionary_hash(key) ;
-	/* Find if value is already in blackboard */
-	if (d->n>0) {
-		for (i=0 ; i<d->size ; i++) {
-            if (d->key[i]==NULL)
-                continue ;
-			if (hash==d->hash[i]) { /* Same hash value */
-				if (!strcmp(key, d->key[i])) {	 /* Same key */
-					/* Found a value: modify and return */
-					if (d->val[i]!=NULL)
-						free(d->val[i]);
-                    d->val[i] = val ? strdup(val) : NULL ;
-                    /* Value has been modified: return */
-					return ;
-				}
-			}
+	dictionary_put(d, key, keylen, dictionary_hashn(key, keylen), val, vallen, 1);
+}
+
+void dictionary_setref(dictionary * d, char * key, int keylen, char * val)
+{
+	if (d==NULL || key==NULL) return ;
+	/* Only arena strings can be adopted, anything else would be freed on unset */
+	dictionary_put(d, key, keylen, dictionary_hashn(key, keylen), val, val ? strlen(val) : 0, !d->arena);
+}
+
+char * dictionary_alloc(dictionary * d, int len)
+{
+	if (d==NULL || !d->arena) return NULL ;
+	return arena_alloc(d, len);
+}
+
+dictionary * dictionary_copy(dictionary * d)
+{
+	dictionary	*	c ;
+	int				i ;
+
+	if (d==NULL) return NULL ;
+	c = dictionary_new(d->n, true);
+	for (i=0 ; i<d->last ; i++) {
+		if (d->key[i]==NULL)
+			continue ;
+		dictionary_put(c, d->key[i], strlen(d->key[i]), d->hash[i],
+				d->val[i], d->val[i] ? strlen(d->val[i]) : 0, 1);
+	}
+	return c ;
+}
+
+/* Moves every entry of src into d, replacing existing values, and frees src */
+void dictionary_merge(dictionary * d, dictionary * src)
+{
+	int		i ;
+	int		n ;
+	int		slot ;
+	int		adopt ;
+	dictionary_block *	b ;
+
+	if (d==NULL || src==NULL) return ;
+
+	/* Strings are moved rather than copied when both sides own them the same way */
+	adopt = d->arena==src->arena ;
+	if (adopt && d->arena && src->blocks!=NULL) {
+		/* Splice the source blocks in behind the block d is filling */
+		for (b=src->blocks ; b->next!=NULL ; b=b->next) ;
+		if (d->blocks==NULL) {
+			d->blocks = src->blocks ;
+		} else {
+			b->next = d->blocks->next ;
+			d->blocks->next = src->blocks ;
 		}
+		src->blocks = NULL ;
 	}
-	/* Add a new value */
-	/* See if dictionary needs to grow */
-	if (d->n==d->size) {
 
-		/* Reached maximum size: reallocate blackboard */
-		d->val  = (char **)mem_double(d->val,  d->size * sizeof(char*)) ;
-		d->key  = (char **)mem_double(d->key,  d->size * sizeof(char*)) ;
-		d->hash = (unsigned int *)mem_double(d->hash, d->size * sizeof(unsigned)) ;
+	dictionary_reserve(d, src->n);
+	for (i=0 ; i<src->last ; i++) {
+		if (src->key[i]==NULL)
+			continue ;
+		n = d->n ;
+		slot = dictionary_put(d, src->key[i], strlen(src->key[i]), src->hash[i],
+				src->val[i], src->val[i] ? strlen(src->val[i]) : 0, !adopt);
+		d->flags[slot] = src->flags[i] ;
+		if (adopt && !d->arena) {
+			/* The key string was only taken for a new entry */
+			if (d->n==n)
+				free(src->key[i]);
+			src->key[i] = NULL ;
+			src->val[i] = NULL ;
+		}
+	}
+	dictionary_del(src);
+}
 
-		/* Double size */
-		d->size *= 2 ;
+/* Private: make room for n more entries, reclaiming holes left by unset first */
+static void dictionary_reserve(dictionary * d, int n)
+{
+	int		size ;
+
+	if (d->last+n<=d->size)
+		return ;
+	if (d->n<d->size/2)
+		dictionary_compact(d);
+	if (d->last+n>d->size) {
+		/* Reallocate blackboard */
+		for (size=2*d->size ; size<d->last+n ; size*=2) ;
+		d->val  = (char **)mem_grow(d->val,  d->size * sizeof(char*), size * sizeof(char*)) ;
+		d->key  = (char **)mem_grow(d->key,  d->size * sizeof(char*), size * sizeof(char*)) ;
+		d->hash = (unsigned int *)mem_grow(d->hash, d->size * sizeof(unsigned), size * sizeof(unsigned)) ;
+
+		d->secid = (int *)mem_grow(d->secid, d->size * sizeof(int), size * sizeof(int)) ;
+		d->snext = (int *)mem_grow(d->snext, d->size * sizeof(int), size * sizeof(int)) ;
+		d->sprev = (int *)mem_grow(d->sprev, d->size * sizeof(int), size * sizeof(int)) ;
+		d->flags = (unsigned char *)mem_grow(d->flags, d->size, size) ;
+		d->typed = (dictionary_value *)mem_grow(d->typed, d->size * sizeof(dictionary_value), size * sizeof(dictionary_value)) ;
+		d->size = size ;
+
+		/* Index stays a power of two at least twice the storage size */
+		if (d->isize<2*d->size) {
+			free(d->index);
+			while (d->isize<2*d->size)
+				d->isize *= 2 ;
+			d->index = (int *)malloc(d->isize * sizeof(int));
+		}
 	}
+	dictionary_reindex(d);
+}
 
-    /* Insert key in the first empty slot */
-    for (i=0 ; i<d->size ; i++) {
-        if (d->key[i]==NULL) {
-            /* Add key here */
-            break ;
-        }
-    }
-	/* Copy key */
-	d->key[i]  = strdup(key);
-    d->val[i]  = val ? strdup(val) : NULL ;
+/* Private: set an entry, copying the strings unless they are being adopted. Returns the slot */
+static int dictionary_put(dictionary * d, const char * key, int keylen, unsigned hash, const char * val, int vallen, int copy)
+{
+	int			i ;
+	int			pos ;
+	int			mask ;
+
+	/* Find if value is already in blackboard */
+	if ((i=dictionary_lookup(d, key, keylen, hash))>=0) {
+		/* Found a value: modify and return (unless it is unchanged) */
+		if (copy && val!=NULL && d->val[i]!=NULL && !strncmp(val, d->val[i], vallen) && d->val[i][vallen]==0) {
+			d->flags[i] = 0 ;
+			return i ;
+		}
+		dictionary_strfree(d, d->val[i]);
+		d->val[i] = val==NULL ? NULL : copy ? dictionary_strndup(d, val, vallen) : (char *)val ;
+		d->flags[i] = 0 ;
+		d->typed[i].have = 0 ;
+		return i ;
+	}
+
+	/* Add a new value */
+	/* See if dictionary needs to grow (or just reclaim holes left by unset) */
+	if (d->last==d->size)
+		dictionary_reserve(d, 1);
+
+	/* Append key after the last used slot */
+	i = d->last++ ;
+	d->key[i]  = copy ? dictionary_strndup(d, key, keylen) : (char *)key ;
+	d->val[i]  = val==NULL ? NULL : copy ? dictionary_strndup(d, val, vallen) : (char *)val ;
 	d->hash[i] = hash;
+	d->flags[i] = 0 ;
+	d->typed[i].have = 0 ;
 	d->n ++ ;
-	return ;
+
+	/* Add to the section index */
+	dictionary_section_link(d, i, dictionary_section_for(d, key, keylen));
+	if (memchr(key, ':', keylen)==NULL)
+		d->sec[d->secid[i]].slot = i ;
+
+	/* Add to the numbered key lists */
+	dictionary_list_add(d, key, keylen, i);
+
+	mask = d->isize - 1 ;
+	for (pos=hash & mask ; d->index[pos]>=0 ; pos=(pos+1) & mask) ;
+	d->index[pos] = i ;
+	return i ;
 }
 
 void dictionary_unset(dictionary * d, char * key)
 {
 	unsigned	hash ;
 	int			i ;
+	int			pos ;
+	int			mask ;
 
 	hash = dictionary_hash(key);
-	for (i=0 ; i<d->size ; i++) {
-        if (d->key[i]==NULL)
-            continue ;
-        /* Compare hash */
-		if (hash==d->hash[i]) {
-            /* Compare string, to avoid hash collisions */
-            if (!strcmp(key, d->key[i])) {
-                /* Found key */
-                break ;
-			}
-		}
+	mask = d->isize - 1 ;
+	for (pos=hash & mask ; (i=d->index[pos])!=INDEX_EMPTY ; pos=(pos+1) & mask) {
+		if (i>=0 && hash==d->hash[i] && !strcmp(key, d->key[i]))
+			break ;
 	}
-    if (i>=d->size)
-        /* Key not found */
-        return ;
+	if (i==INDEX_EMPTY)
+		/* Key not found */
+		return ;
 
-    free(d->key[i]);
-    d->key[i] = NULL ;
-    if (d->val[i]!=NULL) {
-        free(d->val[i]);
-        d->val[i] = NULL ;
-    }
-    d->hash[i] = 0 ;
-    d->n -- ;
-    return ;
+	d->index[pos] = INDEX_DELETED ;
+	dictionary_section_unlink(d, i);
+	dictionary_list_remove(d, key);
+	dictionary_strfree(d, d->key[i]);
+	d->key[i] = NULL ;
+	dictionary_strfree(d, d->val[i]);
+	d->val[i] = NULL ;
+	d->hash[i] = 0 ;
+	d->flags[i] = 0 ;
+	d->typed[i].have = 0 ;
+	d->n -- ;
+	return ;
 }
 
 void dictionary_setint(dictionary * d, char * key, int val)
@@ -240,7 +831,7 @@ void dictionary_dump(dictionary * d, FILE * out)
 		fprintf(out, "empty dictionary\n");
 		return ;
 	}
-	for (i=0 ; i<d->size ; i++) {
+	for (i=0 ; i<d->last ; i++) {
         if (d->key[i]) {
             fprintf(out, "%20s\t[%s]\n",
                     d->key[i],
@@ -262,24 +853,40 @@ iniparser is distributed under an MIT license.
 #define ASCIILINESZ         1024
 #define INI_INVALID_KEY     ((char*)-1)
 
+/* Private: growable buffer used to build section:keyword keys */
+typedef struct _keybuf_ {
+    char *  buf ;
+    int     size ;
+} keybuf ;
+
 /* Private: add an entry to the dictionary */
 static void iniparser_add_entry(
     dictionary * d,
-    char * sec,
-    char * key,
-    char * val)
+    keybuf * kb,
+    const char * sec, int seclen,
+    const char * key, int keylen,
+    const char * val, int vallen)
 {
-    char longkey[2*ASCIILINESZ+1];
+    int     len ;
+
+    if (key==NULL) {
+        dictionary_setn(d, sec, seclen, NULL, 0);
+        return ;
+    }
 
     /* Make a key as section:keyword */
-    if (key!=NULL) {
-        sprintf(longkey, "%s:%s", sec, key);
-    } else {
-        strcpy(longkey, sec);
+    len = seclen + 1 + keylen ;
+    if (len>=kb->size) {
+        free(kb->buf);
+        for (kb->size=ASCIILINESZ ; kb->size<=len ; kb->size*=2) ;
+        kb->buf = (char *)malloc(kb->size);
     }
+    memcpy(kb->buf, sec, seclen);
+    kb->buf[seclen] = ':' ;
+    memcpy(kb->buf+seclen+1, key, keylen);
 
     /* Add (key,val) to dictionary */
-    dictionary_set(d, longkey, val);
+    dictionary_setn(d, kb->buf, len, val, vallen);
     return ;
 }
 
@@ -290,12 +897,9 @@ int iniparser_getnsec(dictionary * d)
 
     if (d==NULL) return -1 ;
     nsec=0 ;
-    for (i=0 ; i<d->size ; i++) {
-        if (d->key[i]==NULL)
-            continue ;
-        if (strchr(d->key[i], ':')==NULL) {
+    for (i=0 ; i<d->nsec ; i++) {
+        if (d->sec[i].slot>=0)
             nsec ++ ;
-        }
     }
     return nsec ;
 }
@@ -303,23 +907,15 @@ int iniparser_getnsec(dictionary * d)
 char * iniparser_getsecname(dictionary * d, int n)
 {
     int i ;
-    int foundsec ;
 
     if (d==NULL || n<0) return NULL ;
-    foundsec=0 ;
-    for (i=0 ; i<d->size ; i++) {
-        if (d->key[i]==NULL)
+    for (i=0 ; i<d->nsec ; i++) {
+        if (d->sec[i].slot<0)
             continue ;
-        if (strchr(d->key[i], ':')==NULL) {
-            foundsec++ ;
-            if (foundsec>n)
-                break ;
-        }
+        if (n-- == 0)
+            return d->key[d->sec[i].slot] ;
     }
-    if (foundsec<=n) {
-        return NULL ;
-    }
-    return d->key[i] ;
+    return NULL ;
 }
 
 void iniparser_dump(dictionary * d, FILE * f)
@@ -327,7 +923,7 @@ void iniparser_dump(dictionary * d, FILE * f)
     int     i ;
 
     if (d==NULL || f==NULL) return ;
-    for (i=0 ; i<d->size ; i++) {
+    for (i=0 ; i<d->last ; i++) {
         if (d->key[i]==NULL)
             continue ;
         if (d->val[i]!=NULL) {
@@ -342,37 +938,31 @@ void iniparser_dump(dictionary * d, FILE * f)
 void iniparser_dump_ini(dictionary * d, FILE * f)
 {
     int     i, j ;
-    char    keym[ASCIILINESZ+1];
-    int     nsec ;
-    char *  secname ;
-    int     seclen ;
+    dictionary_section * s ;
 
     if (d==NULL || f==NULL) return ;
 
-    nsec = iniparser_getnsec(d);
-    if (nsec<1) {
+    if (iniparser_getnsec(d)<1) {
         /* No section in file: dump all keys as they are */
-        for (i=0 ; i<d->size ; i++) {
+        for (i=0 ; i<d->last ; i++) {
             if (d->key[i]==NULL)
                 continue ;
             fprintf(f, "%s = %s\n", d->key[i], d->val[i]);
         }
         return ;
     }
-    for (i=0 ; i<nsec ; i++) {
-        secname = iniparser_getsecname(d, i) ;
-        seclen  = (int)strlen(secname);
-        fprintf(f, "\n[%s]\n", secname);
-        sprintf(keym, "%s:", secname);
-        for (j=0 ; j<d->size ; j++) {
-            if (d->key[j]==NULL)
+    for (i=0 ; i<d->nsec ; i++) {
+        s = &d->sec[i] ;
+        if (s->slot<0)
+            continue ;
+        fprintf(f, "\n[%s]\n", s->name);
+        for (j=s->first ; j>=0 ; j=d->snext[j]) {
+            if (j==s->slot)
                 continue ;
-            if (!strncmp(d->key[j], keym, seclen+1)) {
-                fprintf(f,
-                        "%-30s = %s\n",
-                        d->key[j]+seclen+1,
-                        d->val[j] ? d->val[j] : "");
-            }
+            fprintf(f,
+                    "%-30s = %s\n",
+                    d->key[j]+s->len+1,
+                    d->val[j] ? d->val[j] : "");
         }
     }
     fprintf(f, "\n");
@@ -386,51 +976,74 @@ char * iniparser_getstr(dictionary * d, const char * key)
 
 char * iniparser_getstring(dictionary * d, const char * key, char * def)
 {
-    char * lc_key ;
-    char * sval ;
-
     if (d==NULL || key==NULL)
         return def ;
 
-    lc_key = strdup(key);
-    sval = dictionary_get(d, lc_key, def);
-    free(lc_key);
-    return sval ;
+    return dictionary_get(d, (char *)key, def);
+}
+
+int iniparser_findsec(dictionary * d, const char * sec, const char * key, int fallback)
+{
+    int slot ;
+    int len ;
+
+    if (d==NULL || key==NULL)
+        return -1 ;
+
+    /* Look in the section first, then (optionally) the main section */
+    slot = sec ? dictionary_lookupsec(d, sec, key) : -1 ;
+    if (slot>=0 || (sec && !fallback))
+        return slot ;
+    len = strlen(key);
+    return dictionary_lookup(d, key, len, dictionary_hashn(key, len));
+}
+
+char * iniparser_getsecstring(dictionary * d, const char * sec, const char * key, char * def, int fallback)
+{
+    int slot ;
+
+    slot = iniparser_findsec(d, sec, key, fallback);
+    return slot<0 ? def : dictionary_getval(d, slot) ;
+}
+
+/* Private: slot holding a value for key, or -1 */
+static int iniparser_findval(dictionary * d, const char * key)
+{
+    int     len ;
+    int     slot ;
+
+    if (d==NULL || key==NULL)
+        return -1 ;
+    len = strlen(key);
+    slot = dictionary_lookup(d, key, len, dictionary_hashn(key, len));
+    return (slot>=0 && d->val[slot]!=NULL) ? slot : -1 ;
 }
 
 int iniparser_getint(dictionary * d, const char * key, int notfound)
 {
-    char    *   str ;
+    int     slot ;
 
-    str = iniparser_getstring(d, key, INI_INVALID_KEY);
-    if (str==INI_INVALID_KEY) return notfound ;
-    return (int)strtol(str, NULL, 0);
+    slot = iniparser_findval(d, key);
+    return slot<0 ? notfound : dictionary_getvalint(d, slot) ;
 }
 
 double iniparser_getdouble(dictionary * d, char * key, double notfound)
 {
-    char    *   str ;
+    int     slot ;
 
-    str = iniparser_getstring(d, key, INI_INVALID_KEY);
-    if (str==INI_INVALID_KEY) return notfound ;
-    return atof(str);
+    slot = iniparser_findval(d, key);
+    return slot<0 ? notfound : dictionary_getvaldouble(d, slot) ;
 }
 
 int iniparser_getboolean(dictionary * d, const char * key, int notfound)
 {
-    char    *   c ;
-    int         ret ;
-
-    c = iniparser_getstring(d, key, INI_INVALID_KEY);
-    if (c==INI_INVALID_KEY) return notfound ;
-    if (c[0]=='y' || c[0]=='Y' || c[0]=='1' || c[0]=='t' || c[0]=='T') {
-        ret = 1 ;
-    } else if (c[0]=='n' || c[0]=='N' || c[0]=='0' || c[0]=='f' || c[0]=='F') {
-        ret = 0 ;
-    } else {
-        ret = notfound ;
-    }
-    return ret;
+    int     slot ;
+    int     ret ;
+
+    slot = iniparser_findval(d, key);
+    if (slot<0) return notfound ;
+    ret = dictionary_getvalbool(d, slot);
+    return ret<0 ? notfound : ret ;
 }
 
 int iniparser_find_entry(dictionary * ini, char * entry)
@@ -453,75 +1066,139 @@ void iniparser_unset(dictionary * ini, char * entry)
     dictionary_unset(ini, entry);
 }
 
-void parse_line(char * sec, char * lin, dictionary * d)
-{
-    char        key[ASCIILINESZ+1];
-    char        val[ASCIILINESZ+1];
-    char    *   wher ;
-
-    wher = strskp(lin); /* Skip leading spaces */
-    if (*wher==';' || *wher=='#' || *wher==0)
-        return ; /* Comment lines */
-    else {
-        if (sscanf(wher, "[%[^]]", sec)==1) {
-            /* Valid section name */
-            iniparser_add_entry(d, sec, NULL, NULL);
-        } else if (sscanf (wher, "%[^=] = \"%[^\"]\"", key, val) == 2
-               ||  sscanf (wher, "%[^=] = '%[^\']'",   key, val) == 2
-               ||  sscanf (wher, "%[^=] = %[^;#]",     key, val) == 2) {
-            strcpy(key, strcrop(key));
-            /*
-             * sscanf cannot handle "" or '' as empty value,
-             * this is done here
-             */
-            if (!strcmp(val, "\"\"") || !strcmp(val, "''")) {
-                val[0] = (char)0;
-            } else {
-                strcpy(val, strcrop(val));
+/* Private: true for whitespace that does not end a line */
+#define ISBLANK(c)  ((c)==' ' || (c)=='\t' || (c)=='\r' || (c)=='\v' || (c)=='\f')
+
+/* Private: trim trailing whitespace from a slice */
+static const char * slice_crop(const char * s, const char * e)
+{
+    while (e>s && isspace((unsigned char)e[-1]))
+        e-- ;
+    return e ;
+}
+
+/*
+ * Tokenize INI text in a single pass. The text is not modified and does not
+ * need to be null terminated; sections, keys and values are handed to the
+ * dictionary as slices of the buffer.
+ */
+static void iniparser_parse(dictionary * d, const char * p, const char * end)
+{
+    keybuf          kb ;
+    const char  *   sec ;
+    int             seclen ;
+    const char  *   eol ;
+    const char  *   key ;
+    const char  *   keyend ;
+    const char  *   val ;
+    const char  *   valend ;
+    const char  *   q ;
+
+    kb.buf = NULL ;
+    kb.size = 0 ;
+    sec = "" ;
+    seclen = 0 ;
+
+    for ( ; p<end ; p=eol+1) {
+        eol = (const char *)memchr(p, '\n', end-p);
+        if (eol==NULL)
+            eol = end ;
+
+        /* Skip leading spaces, comment and blank lines */
+        while (p<eol && ISBLANK(*p))
+            p++ ;
+        if (p==eol || *p==';' || *p=='#')
+            continue ;
+
+        /* Section name */
+        if (*p=='[') {
+            for (q=p+1 ; q<eol && *q!=']' ; q++) ;
+            if (q>p+1) {
+                sec = p+1 ;
+                seclen = (int)(q-sec) ;
+                iniparser_add_entry(d, &kb, sec, seclen, NULL, 0, NULL, 0);
+                continue ;
             }
-            iniparser_add_entry(d, sec, key, val);
+        }
 
-			// allow WinRun4J section to be an alias to the main/unnamed section
-			if(sec && !strcmp(sec, "WinRun4J"))
-				iniparser_add_entry(d, "", key, val);
+        /* key = value */
+        key = p ;
+        keyend = (const char *)memchr(p, '=', eol-p);
+        if (keyend==NULL || keyend==key)
+            continue ;
+        val = keyend+1 ;
+        keyend = slice_crop(key, keyend);
+        while (val<eol && isspace((unsigned char)*val))
+            val++ ;
+
+        valend = NULL ;
+        if (val<eol && (*val=='"' || *val=='\'')) {
+            /* Quoted value, runs to the closing quote */
+            for (q=val+1 ; q<eol && *q!=*val ; q++) ;
+            if (q>val+1) {
+                val++ ;
+                valend = q ;
+            }
+        }
+        if (valend==NULL) {
+            /* Plain value, runs to a comment character */
+            for (valend=val ; valend<eol && *valend!=';' && *valend!='#' ; valend++) ;
+            if (valend==val)
+                continue ;
+            if (valend-val>=2 && slice_crop(val, valend)==val+2 &&
+                ((val[0]=='"' && val[1]=='"') || (val[0]=='\'' && val[1]=='\''))) {
+                /* "" or '' is an empty value */
+                valend = val ;
+            }
         }
+        valend = slice_crop(val, valend);
+
+        iniparser_add_entry(d, &kb, sec, seclen, key, (int)(keyend-key), val, (int)(valend-val));
+
+        // allow WinRun4J section to be an alias to the main/unnamed section
+        if (seclen==8 && !strncmp(sec, "WinRun4J", 8))
+            iniparser_add_entry(d, &kb, "", 0, key, (int)(keyend-key), val, (int)(valend-val));
     }
+
+    free(kb.buf);
 }
 
 dictionary * iniparser_load(char * ininame, bool isbuffer)
 {
     dictionary  *   d ;
-    char        sec[ASCIILINESZ+1];
-    char        lin[ASCIILINESZ+1];
-    FILE    *   ini ;
-    int         lineno ;
-	memset(lin, 0, ASCIILINESZ);
-	memset(sec, 0, ASCIILINESZ);
-
-    if (!isbuffer && (ini=fopen(ininame, "r"))==NULL) {
+    HANDLE          hFile ;
+    HANDLE          hMap ;
+    DWORD           size ;
+    char        *   view ;
+
+    if (ininame==NULL)
         return NULL ;
+
+    /* Embedded INI resources are parsed in place */
+    if (isbuffer) {
+        d = dictionary_new(0, true);
+        iniparser_parse(d, ininame, ininame + strlen(ininame));
+        return d ;
     }
 
-	if(isbuffer && !ininame) {
-		return NULL ;
-	}
+    hFile = CreateFile(ininame, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile==INVALID_HANDLE_VALUE)
+        return NULL ;
 
-    /*
-     * Initialize a new dictionary entry
-     */
-    d = dictionary_new(0);
-    lineno = 0 ;
-	int pos = 0;
-	while ((isbuffer ? sgets(ininame, &pos, lin, ASCIILINESZ) : fgets(lin, ASCIILINESZ, ini)) != NULL) {
-		lineno++;
-		parse_line(sec, lin, d);
-		memset(lin, 0, ASCIILINESZ);
+    d = dictionary_new(0, true);
+    size = GetFileSize(hFile, NULL);
+    if (size!=0 && size!=INVALID_FILE_SIZE) {
+        /* Map the file and tokenize it straight out of the view */
+        hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        view = hMap ? (char *)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0) : NULL ;
+        if (view!=NULL) {
+            iniparser_parse(d, view, view + size);
+            UnmapViewOfFile(view);
+        }
+        if (hMap)
+            CloseHandle(hMap);
     }
-
-	if(strlen(lin) != 0)
-		parse_line(sec, lin, d);
-    
-	if(!isbuffer) fclose(ini);
+    CloseHandle(hFile);
 
     return d ;
 }
@@ -610,18 +1287,3 @@ char * strstrip(char * s)
 
 	return (char*)l ;
 }
-
-char* sgets(char* buffer, int* pos, char * line, int maxsize)
-{		
-	if(buffer[*pos] == 0) return NULL;
-	int i = *pos;
-	int offset = 0;
-	for(; offset < maxsize; offset++) {
-		if(buffer[offset + i] == '\n' || buffer[offset + i] == 0)
-			break;
-	}
-	memcpy(line, &buffer[*pos], offset);
-	line[offset] = 0;
-	*pos = i + offset + (buffer[i] == 0 ? 0 : 1);
-	return line;
-}
@@ -0,0 +1,82 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#include "common/Directory.h"
+
+int Directory::List(const char* dir, const char* pattern, DirEntry** entries)
+{
+	*entries = NULL;
+	int dlen = strlen(dir);
+	int plen = strlen(pattern);
+	char* search = (char*) malloc(dlen + plen + 2);
+	memcpy(search, dir, dlen);
+	search[dlen] = '\\';
+	memcpy(&search[dlen + 1], pattern, plen + 1);
+
+	WIN32_FIND_DATA fd;
+	HANDLE h = FindFirstFile(dlen ? search : pattern, &fd);
+	free(search);
+	if(h == INVALID_HANDLE_VALUE)
+		return 0;
+
+	int count = 0, size = 0;
+	do {
+		if(strcmp(fd.cFileName, ".") == 0 || strcmp(fd.cFileName, "..") == 0)
+			continue;
+		if(count == size) {
+			size = size ? size * 2 : 16;
+			*entries = (DirEntry*) realloc(*entries, size * sizeof(DirEntry));
+		}
+		(*entries)[count].name = strdup(fd.cFileName);
+		(*entries)[count].isDir = (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+		(*entries)[count].isLink = (fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0;
+		count++;
+	} while(FindNextFile(h, &fd));
+	FindClose(h);
+
+	return count;
+}
+
+void Directory::Free(DirEntry* entries, int count)
+{
+	for(int i = 0; i < count; i++)
+		free(entries[i].name);
+	free(entries);
+}
+
+bool Directory::IsEmpty(const char* dir)
+{
+	char search[MAX_PATH];
+	_snprintf(search, MAX_PATH, "%s\\*", dir);
+	search[MAX_PATH - 1] = 0;
+	WIN32_FIND_DATA fd;
+	HANDLE h = FindFirstFile(search, &fd);
+	if(h == INVALID_HANDLE_VALUE)
+		return true;
+	bool empty = true;
+	do {
+		empty = strcmp(fd.cFileName, ".") == 0 || strcmp(fd.cFileName, "..") == 0;
+	} while(empty && FindNextFile(h, &fd));
+	FindClose(h);
+	return empty;
+}
+
+bool Directory::Exists(const char* path)
+{
+	return GetFileAttributes(path) != INVALID_FILE_ATTRIBUTES;
+}
+
+ULONGLONG Directory::GetWriteTime(const char* path)
+{
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+	if(!GetFileAttributesEx(path, GetFileExInfoStandard, &fad))
+		return 0;
+	return (((ULONGLONG) fad.ftLastWriteTime.dwHighDateTime) << 32) | fad.ftLastWriteTime.dwLowDateTime;
+}
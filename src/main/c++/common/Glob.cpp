@@ -0,0 +1,282 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#include "common/Glob.h"
+#include <ctype.h>
+
+#define TOKEN_CHAR  0
+#define TOKEN_ANY   1
+#define TOKEN_STAR  2
+#define TOKEN_CLASS 3
+
+static bool IsSeparator(char c)
+{
+	return c == '/' || c == '\\';
+}
+
+// Finds the closing bracket of a class, a '[' without one is a literal
+static const char* FindClassEnd(const char* p, const char* end)
+{
+	const char* q = p + 1;
+	if(q < end && (*q == '!' || *q == '^'))
+		q++;
+	if(q < end && *q == ']')
+		q++;
+	while(q < end && *q != ']')
+		q++;
+	return q < end ? q : NULL;
+}
+
+static bool IsEscape(const char* p, const char* end)
+{
+	return *p == GLOB_ESCAPE && p + 1 < end;
+}
+
+static bool HasWildcard(const char* p, const char* end)
+{
+	for(; p < end; p++) {
+		if(IsEscape(p, end))
+			p++;
+		else if(*p == '*' || *p == '?' || (*p == '[' && FindClassEnd(p, end)))
+			return true;
+	}
+	return false;
+}
+
+// Copies the text with the escapes removed
+static char* Unescape(const char* p, const char* end)
+{
+	char* text = (char*) malloc(end - p + 1);
+	char* t = text;
+	for(; p < end; p++) {
+		if(IsEscape(p, end))
+			p++;
+		*t++ = *p;
+	}
+	*t = 0;
+	return text;
+}
+
+static void AddToSet(BYTE* set, BYTE c)
+{
+	BYTE l = tolower(c), u = toupper(c);
+	set[l >> 3] |= 1 << (l & 7);
+	set[u >> 3] |= 1 << (u & 7);
+}
+
+static void CompilePart(GlobPart* part, const char* p, const char* end)
+{
+	part->text = Unescape(p, end);
+	part->tokens = NULL;
+	part->tokenCount = 0;
+	if(end - p == 2 && p[0] == '*' && p[1] == '*') {
+		part->type = GLOB_ANYDIRS;
+		return;
+	}
+	if(!HasWildcard(p, end)) {
+		part->type = GLOB_LITERAL;
+		return;
+	}
+
+	part->type = GLOB_MATCH;
+	part->tokens = (GlobToken*) calloc(end - p, sizeof(GlobToken));
+	while(p < end) {
+		GlobToken* t = &part->tokens[part->tokenCount];
+		const char* close;
+		if(IsEscape(p, end)) {
+			t->op = TOKEN_CHAR;
+			t->c = tolower((BYTE) p[1]);
+			p += 2;
+		} else if(*p == '*') {
+			// Runs of stars are the same as one
+			if(part->tokenCount == 0 || t[-1].op != TOKEN_STAR) {
+				t->op = TOKEN_STAR;
+				part->tokenCount++;
+			}
+			p++;
+			continue;
+		} else if(*p == '?') {
+			t->op = TOKEN_ANY;
+			p++;
+		} else if(*p == '[' && (close = FindClassEnd(p, end)) != NULL) {
+			t->op = TOKEN_CLASS;
+			const char* q = p + 1;
+			bool negate = *q == '!' || *q == '^';
+			if(negate)
+				q++;
+			for(; q < close; q++) {
+				if(q + 2 < close && q[1] == '-') {
+					for(int c = (BYTE) q[0]; c <= (BYTE) q[2]; c++)
+						AddToSet(t->set, c);
+					q += 2;
+				} else {
+					AddToSet(t->set, *q);
+				}
+			}
+			if(negate) {
+				for(int i = 0; i < sizeof(t->set); i++)
+					t->set[i] = ~t->set[i];
+			}
+			p = close + 1;
+		} else {
+			t->op = TOKEN_CHAR;
+			t->c = tolower((BYTE) *p);
+			p++;
+		}
+		part->tokenCount++;
+	}
+}
+
+GlobPattern* Glob::Compile(const char* pattern)
+{
+	GlobPattern* glob = (GlobPattern*) malloc(sizeof(GlobPattern));
+	glob->parts = NULL;
+	glob->partCount = 0;
+
+	// Find the first component with a wildcard
+	const char* p = pattern;
+	const char* start = pattern;
+	while(*p) {
+		while(IsSeparator(*p))
+			p++;
+		const char* end = p;
+		while(*end && !IsSeparator(*end))
+			end++;
+		if(p < end && (HasWildcard(p, end) || end - p == 2 && p[0] == '*' && p[1] == '*'))
+			break;
+		start = end;
+		p = end;
+	}
+	glob->base = Unescape(pattern, start);
+	if(!*p)
+		return glob;
+
+	// Compile the rest, one part per component
+	int count = 1;
+	for(const char* q = p; *q; q++) {
+		if(IsSeparator(*q))
+			count++;
+	}
+	glob->parts = (GlobPart*) malloc(count * sizeof(GlobPart));
+	while(*p) {
+		const char* end = p;
+		while(*end && !IsSeparator(*end))
+			end++;
+		bool anyDirs = end - p == 2 && p[0] == '*' && p[1] == '*';
+		GlobPart* prev = glob->partCount ? &glob->parts[glob->partCount - 1] : NULL;
+		if(end > p && !(anyDirs && prev && prev->type == GLOB_ANYDIRS))
+			CompilePart(&glob->parts[glob->partCount++], p, end);
+		p = end;
+		while(IsSeparator(*p))
+			p++;
+	}
+	return glob;
+}
+
+void Glob::Free(GlobPattern* glob)
+{
+	if(!glob)
+		return;
+	for(int i = 0; i < glob->partCount; i++) {
+		free(glob->parts[i].text);
+		free(glob->parts[i].tokens);
+	}
+	free(glob->parts);
+	free(glob->base);
+	free(glob);
+}
+
+static bool MatchToken(GlobToken* t, BYTE c)
+{
+	switch(t->op) {
+	case TOKEN_CHAR:
+		return t->c == tolower(c);
+	case TOKEN_ANY:
+		return true;
+	default:
+		return (t->set[c >> 3] & (1 << (c & 7))) != 0;
+	}
+}
+
+// Matches one component, on a mismatch only the last star is backtracked
+static bool MatchComponent(GlobPart* part, const char* s, const char* end)
+{
+	if(part->type == GLOB_ANYDIRS)
+		return true;
+	if(part->type == GLOB_LITERAL)
+		return strlen(part->text) == end - s && _strnicmp(part->text, s, end - s) == 0;
+
+	GlobToken* t = part->tokens;
+	int n = part->tokenCount;
+	int ti = 0, star = -1;
+	const char* mark = NULL;
+	while(s < end) {
+		if(ti < n && t[ti].op == TOKEN_STAR) {
+			star = ti++;
+			mark = s;
+		} else if(ti < n && MatchToken(&t[ti], *s)) {
+			ti++;
+			s++;
+		} else if(star >= 0) {
+			ti = star + 1;
+			s = ++mark;
+		} else {
+			return false;
+		}
+	}
+	while(ti < n && t[ti].op == TOKEN_STAR)
+		ti++;
+	return ti == n;
+}
+
+bool Glob::MatchPart(GlobPart* part, const char* name)
+{
+	return MatchComponent(part, name, name + strlen(name));
+}
+
+static bool MatchFrom(GlobPattern* glob, int i, const char* s)
+{
+	while(IsSeparator(*s))
+		s++;
+	if(i == glob->partCount)
+		return *s == 0;
+
+	if(glob->parts[i].type == GLOB_ANYDIRS) {
+		// Try matching no directories, then one more each time round
+		for(;;) {
+			if(MatchFrom(glob, i + 1, s))
+				return true;
+			if(*s == 0)
+				return false;
+			while(*s && !IsSeparator(*s))
+				s++;
+			while(IsSeparator(*s))
+				s++;
+		}
+	}
+
+	const char* end = s;
+	while(*end && !IsSeparator(*end))
+		end++;
+	return end > s && MatchComponent(&glob->parts[i], s, end) && MatchFrom(glob, i + 1, end);
+}
+
+bool Glob::Match(GlobPattern* glob, const char* path)
+{
+	const char* b = glob->base;
+	const char* s = path;
+	for(; *b; b++, s++) {
+		if(IsSeparator(*b) ? !IsSeparator(*s) : tolower((BYTE) *b) != tolower((BYTE) *s))
+			return false;
+	}
+	if(*glob->base && *s && !IsSeparator(*s))
+		return false;
+	return MatchFrom(glob, 0, s);
+}
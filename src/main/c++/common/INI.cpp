@@ -10,6 +10,8 @@
 
 #include "common/INI.h"
 #include "common/Log.h"
+#include "common/INICache.h"
+#include "common/Profile.h"
 #include "java\JNI.h"
 
 #define ALLOW_INI_OVERRIDE    ":ini.override"
@@ -18,38 +20,33 @@
 
 static dictionary* g_ini = NULL;
 
+// Read-only copy of g_ini for callers on other threads. Replaced snapshots are
+// kept until exit as readers may still hold their strings.
+static dictionary* volatile g_snapshot = NULL;
+static dictionary** g_retired = NULL;
+static int g_retiredCount = 0;
+
 UINT INI::GetNumberedKeysMax(dictionary* ini, TCHAR* keyName)
 {
-	UINT idx = 0, max = 0;
-	TCHAR entryName[MAX_PATH];
-	while(true) {
-		sprintf(entryName, "%s.%d", keyName, idx+1);
-		TCHAR* entry = iniparser_getstr(ini, entryName);
-		if(idx > 10 && entry == NULL )
-			break;
-		idx++;
-		if(entry) 
-			max = idx;
-	}
-	return max;
+	dictionary_list* list = dictionary_getlist(ini, keyName);
+	return list ? list->num[list->n - 1] : 0;
 }
 
-void INI::GetNumberedKeysFromIni(dictionary* ini, TCHAR* keyName, TCHAR** entries, UINT& index, UINT max)
+// Returns a NULL terminated copy of the keyName.N values (in order) with room for
+// reserve more entries. The caller frees the entries and the array.
+TCHAR** INI::GetNumberedKeysFromIni(dictionary* ini, TCHAR* keyName, UINT& count, UINT reserve)
 {
-	UINT i = 0;
-	TCHAR entryName[MAX_PATH];
-	while(true) {
-		sprintf(entryName, "%s.%d", keyName, i+1);
-		TCHAR* entry = iniparser_getstr(ini, entryName);
-		if(entry != NULL) {
-			entries[index++] = _strdup(entry);
-		}
-		i++;
-		if(i > max && entry == NULL) {
-			break;
-		}
+	dictionary_list* list = dictionary_getlist(ini, keyName);
+	UINT n = list ? list->n : 0;
+	TCHAR** entries = (TCHAR**) malloc((n + reserve + 1) * sizeof(TCHAR*));
+	count = 0;
+	for(UINT i = 0; i < n; i++) {
+		TCHAR* entry = dictionary_getval(ini, list->slot[i]);
+		if(entry != NULL)
+			entries[count++] = _strdup(entry);
 	}
-	entries[index] = NULL;
+	entries[count] = NULL;
+	return entries;
 }
 
 void INI::SetNumberedKeys(dictionary* ini, TCHAR* keyName, TCHAR** entries, UINT count)
@@ -82,13 +79,70 @@ dictionary* INI::LoadIniFile(HINSTANCE hInstance)
 
 dictionary* INI::LoadIniFile(HINSTANCE hInstance, LPSTR inifile)
 {
-	dictionary* ini = NULL;
-
 	// Set DIR environment variable so that it can be used in the INI file
 	TCHAR inidir[MAX_PATH];
 	GetFileDirectory(inifile, inidir);
 	SetEnvironmentVariable("INI_DIR", inidir);
 
+	// Add module name to ini
+	TCHAR filename[MAX_PATH];
+	GetModuleFileName(hInstance, filename, MAX_PATH);
+
+	// Use the snapshot of a previous launch if none of its inputs have changed
+	LONGLONG start = Profile::Start();
+	bool stale = false;
+	dictionary* ini = INICache::Load(inifile, stale);
+	Profile::End(PROFILE_INI_CACHE, start);
+	bool cached = ini != NULL;
+	if(!ini) {
+		INICache::Reset();
+		INICache::AddFile(filename);
+		ini = LoadIniKeys(hInstance, inifile);
+		if(ini == NULL) {
+			return NULL;
+		}
+		if(iniparser_getboolean(ini, INI_CACHE, 0)) {
+			ExpandAll(ini);
+			INICache::Save(ini, inifile);
+		} else if(stale) {
+			INICache::Delete(inifile);
+		}
+	}
+
+	iniparser_setstr(ini, MODULE_INI, inifile);
+	iniparser_setstr(ini, INI_DIR, inidir);
+	iniparser_setstr(ini, MODULE_NAME, filename);
+
+	// strip off filename to get module directory
+	TCHAR filedir[MAX_PATH];
+	GetFileDirectory(filename, filedir);
+	iniparser_setstr(ini, MODULE_DIR, filedir);
+
+	// Log init
+	Log::Init(hInstance, iniparser_getstr(ini, LOG_FILE), iniparser_getstr(ini, LOG_LEVEL), ini);
+	Log::Info("Module Name: %s", filename);
+	Log::Info("Module INI: %s", inifile);
+	Log::Info("Module Dir: %s", filedir);
+	Log::Info("INI Dir: %s", filedir);
+	if(cached) {
+		Log::Info("INI keys loaded from cache");
+	} else if(stale) {
+		Log::Info("INI cache out of date - keys reloaded");
+	}
+
+	// Store a reference to be used by JNI functions
+	g_ini = ini;
+
+	Profile::End(PROFILE_INI, start);
+
+	return ini;
+}
+
+// Loads, merges and expands the embedded, module and external INI keys
+dictionary* INI::LoadIniKeys(HINSTANCE hInstance, LPSTR inifile)
+{
+	dictionary* ini = NULL;
+
 	// First attempt to load INI from exe
 	HRSRC hi = FindResource(hInstance, MAKEINTRESOURCE(1), RT_INI_FILE);
 	if(hi) {
@@ -96,7 +150,9 @@ dictionary* INI::LoadIniFile(HINSTANCE hInstance, LPSTR inifile)
 		PBYTE pb = (PBYTE) LockResource(hg);
 		DWORD* pd = (DWORD*) pb;
 		if(pd && *pd == INI_RES_MAGIC) {
+			LONGLONG start = Profile::Start();
 			ini = iniparser_load((char *) &pb[RES_MAGIC_SIZE], true);	
+			Profile::End(PROFILE_INI_PARSE, start);
 			if(!ini) {
 				Log::Warning("Could not load embedded INI file");
 			}
@@ -106,107 +162,80 @@ dictionary* INI::LoadIniFile(HINSTANCE hInstance, LPSTR inifile)
 	// Check if we have already loaded an embedded INI file - if so 
 	// then we only need to load and merge the INI file (if present)
 	if(ini && iniparser_getboolean(ini, ALLOW_INI_OVERRIDE, 1)) {
+		INICache::AddFile(inifile);
+		LONGLONG start = Profile::Start();
 		dictionary* ini2 = iniparser_load(inifile);
+		Profile::End(PROFILE_INI_PARSE, start);
 		if(ini2) {
-			for(int i = 0; i < ini2->n; i++) {
-				char* key = ini2->key[i];
-				char* value = ini2->val[i];
-				iniparser_setstr(ini, key, value);
-			}		
-			iniparser_freedict(ini2);
+			start = Profile::Start();
+			dictionary_merge(ini, ini2);
+			Profile::End(PROFILE_INI_MERGE, start);
 		}
 	} else if(!ini) {
+		INICache::AddFile(inifile);
+		LONGLONG start = Profile::Start();
 		ini = iniparser_load(inifile);
+		Profile::End(PROFILE_INI_PARSE, start);
 		if(ini == NULL) {
 			Log::Error("Could not load INI file: %s", inifile);
 			return NULL;
 		}
 	}
 
-	// Expand environment variables
-	ExpandVariables(ini);
-
-	// Expand registry variables
-	ExpandRegistryVariables(ini);
+	// Expand environment, registry and key references as they are read
+	ExpandVariables(ini, NULL, true);
 
 	// Now check if we have an external file to load
 	char* iniFileLocation = iniparser_getstr(ini, INI_FILE_LOCATION);
 	if(iniFileLocation) {
 		Log::Info("Loading INI keys from file location: %s", iniFileLocation);
+		INICache::AddFile(iniFileLocation);
+		LONGLONG start = Profile::Start();
 		dictionary* ini3 = iniparser_load(iniFileLocation);
+		Profile::End(PROFILE_INI_PARSE, start);
 		if(ini3) {
-			ExpandVariables(ini3);
-			for(int i = 0; i < ini3->n; i++) {
-				char* key = ini3->key[i];
-				char* value = ini3->val[i];
-				iniparser_setstr(ini, key, value);
-			}		
-			iniparser_freedict(ini3);
+			ExpandVariables(ini3, ini);
+			start = Profile::Start();
+			dictionary_merge(ini, ini3);
+			Profile::End(PROFILE_INI_MERGE, start);
 		} else {
 			Log::Warning("Could not load INI keys from file: %s", iniFileLocation);
 		}
 	}
 
 	// Attempt to parse registry location to include keys if present
+	LONGLONG start = Profile::Start();
 	ParseRegistryKeys(ini);
-
-	iniparser_setstr(ini, MODULE_INI, inifile);
-	iniparser_setstr(ini, INI_DIR, inidir);
-
-	// Add module name to ini
-	TCHAR filename[MAX_PATH];
-	GetModuleFileName(hInstance, filename, MAX_PATH);
-	iniparser_setstr(ini, MODULE_NAME, filename);
-
-	// strip off filename to get module directory
-	TCHAR filedir[MAX_PATH];
-	GetFileDirectory(filename, filedir);
-	iniparser_setstr(ini, MODULE_DIR, filedir);
-
-	// Log init
-	Log::Init(hInstance, iniparser_getstr(ini, LOG_FILE), iniparser_getstr(ini, LOG_LEVEL), ini);
-	Log::Info("Module Name: %s", filename);
-	Log::Info("Module INI: %s", inifile);
-	Log::Info("Module Dir: %s", filedir);
-	Log::Info("INI Dir: %s", filedir);
-
-	// Store a reference to be used by JNI functions
-	g_ini = ini;
+	Profile::End(PROFILE_INI_REGISTRY, start);
 
 	return ini;
 }
 
 char* INI::GetString(dictionary* ini, const TCHAR* section, const TCHAR* key, TCHAR* defValue, bool defFromMainSection)
 {
-	char tmp[MAX_PATH];
-	tmp[0] = 0;
-	if(section)
-		strcat(tmp, section);
-	strcat(tmp, key);
-	if(section && defFromMainSection) defValue = iniparser_getstring(ini, key, defValue);
-	return iniparser_getstring(ini, tmp, defValue);
+	return iniparser_getsecstring(ini, section, key, defValue, defFromMainSection);
 }
 
 int INI::GetInteger(dictionary* ini, const TCHAR* section, const TCHAR* key, int defValue, bool defFromMainSection)
 {
-	char tmp[MAX_PATH];
-	tmp[0] = 0;
-	if(section)
-		strcat(tmp, section);
-	strcat(tmp, key);
-	if(section && defFromMainSection) defValue = iniparser_getint(ini, key, defValue);
-	return iniparser_getint(ini, tmp, defValue);
+	int slot = iniparser_findsec(ini, section, key, defFromMainSection);
+	if(slot < 0 || dictionary_getval(ini, slot) == NULL)
+		return defValue;
+	return dictionary_getvalint(ini, slot);
 }
 
 bool INI::GetBoolean(dictionary* ini, const TCHAR* section, const TCHAR* key, bool defValue, bool defFromMainSection)
 {
-	char tmp[MAX_PATH];
-	tmp[0] = 0;
-	if(section)
-		strcat(tmp, section);
-	strcat(tmp, key);
-	if(section && defFromMainSection) defValue = iniparser_getboolean(ini, key, defValue);
-	return iniparser_getboolean(ini, tmp, defValue);
+	int slot = iniparser_findsec(ini, section, key, defFromMainSection);
+	int value = slot < 0 || dictionary_getval(ini, slot) == NULL ? -1 : dictionary_getvalbool(ini, slot);
+
+	// A section value that is not a boolean falls back to the main section
+	if(value < 0 && section && defFromMainSection) {
+		int main = iniparser_findsec(ini, NULL, key, 1);
+		if(main >= 0 && main != slot && dictionary_getval(ini, main) != NULL)
+			value = dictionary_getvalbool(ini, main);
+	}
+	return value < 0 ? defValue : value != 0;
 }
 
 void INI::ParseRegistryKeys(dictionary* ini)
@@ -218,6 +247,7 @@ void INI::ParseRegistryKeys(dictionary* ini)
 	}
 
 	Log::Info("Loading INI keys from registry: %s", iniRegistryLocation);
+	INICache::AddRegistryKey(iniRegistryLocation, KEY_READ);
 
 	// find root key
 	int len = strlen(iniRegistryLocation);
@@ -290,119 +320,322 @@ HKEY INI::GetHKey(char* key)
 	return hKey;
 }
 
-int INI::GetRegistryValue(char* input, char* output, int len)
+// Returns a copy of the value at root\key:name, or NULL if it cannot be read
+char* INI::GetRegistryValue(const char* input)
 {
-	Log::Info("GetRegistryValue input (%s), output (%s), len (%d)", input, output, len);
-	char rootKey[4096];
-	strcpy(rootKey, input);
-	char* slash = strchr(rootKey, '\\');
+	char* location = strdup(input);
+	char* slash = strchr(location, '\\');
 	if(slash == NULL) {
 		Log::Warning("Invalid registry key, no backslash found (%s)", input);
-		return ERROR_INVALID_DATA;
+		free(location);
+		return NULL;
 	}
-	*slash = 0;
-	char* key = slash + 1;
-
-	Log::Info("GetRegistryValue rootKey (%s)", rootKey);
-
-	HKEY hKey = GetHKey(rootKey);
-
-	Log::Info("GetRegistryValue full key (%s)", key);
-
-	char* colon = strchr(key, ':');
+	char* colon = strchr(slash, ':');
 	if(colon == NULL) {
 		Log::Warning("Invalid registry key, no key name found (%s)", input);
-		return ERROR_INVALID_DATA;
+		free(location);
+		return NULL;
 	}
-
 	*colon = 0;
-
-	Log::Info("GetRegistryValue stripped key (%s)", key);
-
 	char* valueName = colon + 1;
 
-	Log::Info("GetRegistryValue valueName (%s)", valueName);
+	// The value is part of the cached keys so track the key it came from
+	INICache::AddRegistryKey(location, KEY_READ|KEY_WOW64_64KEY);
 
-	HKEY subKey;
+	*slash = 0;
+	HKEY hKey = GetHKey(location);
+	if(hKey == 0) {
+		Log::Warning("Unrecognized registry root key: %s", location);
+		free(location);
+		return NULL;
+	}
 
-	long result = RegOpenKeyEx(hKey, key, 0, KEY_READ|KEY_WOW64_64KEY, &subKey);
+	HKEY subKey;
+	long result = RegOpenKeyEx(hKey, slash + 1, 0, KEY_READ|KEY_WOW64_64KEY, &subKey);
 	if(result != ERROR_SUCCESS) {
 		Log::Warning("Unable to open registry key (%s) error (%d)", input, result);
-		return ERROR_INVALID_DATA;
+		free(location);
+		return NULL;
 	}
 
-	DWORD type;
-	if(RegQueryValueEx(subKey, valueName, NULL, (LPDWORD)&type, (LPBYTE)output, (LPDWORD)&len) != ERROR_SUCCESS) {
-		Log::Warning("Unable to get registry value (%s)", input);
-		return ERROR_INVALID_DATA;
+	DWORD type, size = 0;
+	char* output = NULL;
+	if(RegQueryValueEx(subKey, valueName, NULL, &type, NULL, &size) == ERROR_SUCCESS &&
+		(type == REG_SZ || type == REG_DWORD)) {
+		// Room for a terminator the stored string may lack, or the formatted DWORD
+		output = (char*) malloc(size + 16);
+		if(RegQueryValueEx(subKey, valueName, NULL, &type, (LPBYTE) output, &size) != ERROR_SUCCESS) {
+			free(output);
+			output = NULL;
+		} else if(type == REG_DWORD) {
+			DWORD val = *((LPDWORD)output);
+			sprintf(output, "%d", val);
+		} else {
+			output[size] = 0;
+		}
 	}
-	if(type != REG_DWORD && type != REG_SZ) {
-		return ERROR_INVALID_DATA;
+	if(output == NULL) {
+		Log::Warning("Unable to get registry value (%s)", input);
 	}
-	if(type == REG_DWORD) {
-		DWORD val = *((LPDWORD)output);
-		sprintf(output, "%d", val);
+	RegCloseKey(subKey);
+	free(location);
+
+	return output;
+}
+
+typedef struct {
+	char* buf;
+	int len;
+	int size;
+} ExpandBuffer;
+
+struct Expansion {
+	dictionary* ini;
+	dictionary* parent;   // already expanded keys that ${...} may also refer to
+	dictionary* lookups;  // memoized environment (%NAME) and registry ($NAME) values
+	ExpandBuffer key;
+};
+
+static void ExpandAppend(ExpandBuffer* b, const char* s, int len)
+{
+	if(b->len + len >= b->size) {
+		while(b->len + len >= b->size)
+			b->size = b->size ? b->size * 2 : 256;
+		b->buf = (char*) realloc(b->buf, b->size);
 	}
+	memcpy(b->buf + b->len, s, len);
+	b->len += len;
+	b->buf[b->len] = 0;
+}
 
-	return ERROR_SUCCESS;
+// Looks up (once per expansion) an environment variable or registry value
+const char* INI::ExpandLookup(Expansion* e, char kind, const char* name, int len)
+{
+	e->key.len = 0;
+	ExpandAppend(&e->key, &kind, 1);
+	ExpandAppend(&e->key, name, len);
+	int slot = dictionary_lookup(e->lookups, e->key.buf, e->key.len, dictionary_hashn(e->key.buf, e->key.len));
+	if(slot >= 0)
+		return e->lookups->val[slot];
+
+	LONGLONG start = Profile::Start();
+	char* value = NULL;
+	char* var = &e->key.buf[1];
+	if(kind == '%') {
+		INICache::AddEnvironment(var, len);
+		DWORD size = GetEnvironmentVariable(var, NULL, 0);
+		if(size) {
+			value = (char*) malloc(size);
+			if(!GetEnvironmentVariable(var, value, size))
+				value[0] = 0;
+		}
+	} else {
+		value = GetRegistryValue(var);
+	}
+	Profile::End(kind == '%' ? PROFILE_INI_ENV : PROFILE_INI_REGISTRY, start);
+	dictionary_setn(e->lookups, e->key.buf, e->key.len, value, value ? strlen(value) : 0);
+	free(value);
+	return dictionary_get(e->lookups, e->key.buf, NULL);
 }
 
-void INI::ExpandRegistryVariables(dictionary* ini)
+// Resolves a ${key} reference, keys without a section refer to the main section
+const char* INI::ExpandReference(Expansion* e, const char* name, int len)
 {
-	char tmp[4096];
-	char result[4096];
-	int len = 4096;
-	for(int i = 0; i < ini->size; i++) {
-		char* key = ini->key[i];
-		char* value = ini->val[i];
-		if(value == NULL) {
-			continue;
+	e->key.len = 0;
+	if(memchr(name, ':', len) == NULL)
+		ExpandAppend(&e->key, ":", 1);
+	ExpandAppend(&e->key, name, len);
+	unsigned hash = dictionary_hashn(e->key.buf, e->key.len);
+	int slot = dictionary_lookup(e->ini, e->key.buf, e->key.len, hash);
+	if(slot >= 0) {
+		if(e->ini->flags[slot] & DICT_EXPANDING) {
+			Log::Warning("Circular reference to %s not expanded", e->ini->key[slot]);
+			return NULL;
 		}
-		strcpy(tmp, value);
-		char* expansionStart = strstr(tmp, "$REG{");
-		if(expansionStart == NULL) {
+		return ExpandValue(e, slot);
+	}
+	if(e->parent) {
+		slot = dictionary_lookup(e->parent, e->key.buf, e->key.len, hash);
+		if(slot >= 0)
+			return dictionary_getval(e->parent, slot);
+	}
+	return NULL;
+}
+
+// Expands the %VAR%, $REG{...} and ${key} tokens of one value, expanding any
+// referenced keys first. Unresolved tokens are left as they are.
+char* INI::ExpandValue(Expansion* e, int slot)
+{
+	char* value = e->ini->val[slot];
+	if(!(e->ini->flags[slot] & DICT_EXPAND))
+		return value;
+	e->ini->flags[slot] = DICT_EXPANDING;
+
+	ExpandBuffer out = { NULL, 0, 0 };
+	const char* copied = value;
+	const char* p = value;
+	while((p = strpbrk(p, "%$")) != NULL) {
+		const char* result = NULL;
+		const char* end;
+		if(*p == '%') {
+			// As ExpandEnvironmentStrings the closing % may start the next
+			// variable when this one is not defined
+			end = strchr(p + 1, '%');
+			if(end == NULL) {
+				p++;
+				continue;
+			}
+			if(end > p + 1)
+				result = ExpandLookup(e, '%', p + 1, end - p - 1);
+		} else if(p[1] == '{') {
+			end = strchr(p + 2, '}');
+			if(end == NULL)
+				break;
+			result = ExpandReference(e, p + 2, end - p - 2);
+		} else if(strncmp(p, "$REG{", 5) == 0) {
+			end = strchr(p + 5, '}');
+			if(end == NULL)
+				break;
+			result = ExpandLookup(e, '$', p + 5, end - p - 5);
+		} else {
+			p++;
 			continue;
 		}
-		char* keyStart = expansionStart + 5;
-		*expansionStart = 0;
-		char* regEnd = strchr(keyStart, '}');
-		if(regEnd == NULL) {
+		if(result == NULL) {
+			p = *p == '%' ? end : end + 1;
 			continue;
 		}
-		*regEnd = 0;
-		if(GetRegistryValue(keyStart, result, len) == ERROR_SUCCESS) {
-			char ev[4096];
-			strcpy(ev, tmp);
-			strcat(ev, result);
-			strcat(ev, regEnd + 1);
-			Log::Info("Reg: %s = '%s' to '%s'", key, value, ev);
-			iniparser_setstr(ini, key, ev);
+		ExpandAppend(&out, copied, p - copied);
+		ExpandAppend(&out, result, strlen(result));
+		copied = p = end + 1;
+	}
+
+	// Only values that actually changed are written back
+	if(out.buf) {
+		ExpandAppend(&out, copied, strlen(copied));
+		char* key = e->ini->key[slot];
+		dictionary_setn(e->ini, key, strlen(key), out.buf, out.len);
+		free(out.buf);
+	}
+	e->ini->flags[slot] = 0;
+	return e->ini->val[slot];
+}
+
+// Marks the values holding variables and either expands them all now or
+// leaves each to be expanded the first time it is read
+void INI::ExpandVariables(dictionary* ini, dictionary* parent, bool lazy)
+{
+	int pending = 0;
+	for(int i = 0; i < ini->last; i++) {
+		if(ini->key[i] != NULL && ini->val[i] != NULL && strpbrk(ini->val[i], "%$") != NULL) {
+			ini->flags[i] |= DICT_EXPAND;
+			pending++;
 		}
 	}
+	if(pending == 0)
+		return;
+	if(ini->expand != NULL) {
+		if(!lazy)
+			ExpandAll(ini);
+		return;
+	}
+
+	Expansion* e = (Expansion*) malloc(sizeof(Expansion));
+	e->ini = ini;
+	e->parent = parent;
+	e->lookups = dictionary_new(0, true);
+	e->key.buf = NULL;
+	e->key.len = e->key.size = 0;
+	ini->expand = ExpandSlot;
+	ini->expandctx = e;
+	if(!lazy)
+		ExpandAll(ini);
+}
+
+char* INI::ExpandSlot(dictionary* ini, int slot)
+{
+	Expansion* e = (Expansion*) ini->expandctx;
+	if(slot >= 0)
+		return ExpandValue(e, slot);
+
+	// Release the expansion state, anything still pending stays as it is
+	ini->expand = NULL;
+	ini->expandctx = NULL;
+	dictionary_del(e->lookups);
+	free(e->key.buf);
+	free(e);
+	return NULL;
+}
+
+// Expands every value still waiting and releases the expansion state, so
+// that later calls find nothing to do and return at once
+void INI::ExpandAll(dictionary* ini)
+{
+	if(ini->expand == NULL)
+		return;
+	for(int i = 0; i < ini->last; i++) {
+		if(ini->key[i] != NULL && (ini->flags[i] & DICT_EXPAND))
+			dictionary_getval(ini, i);
+	}
+	ExpandSlot(ini, -1);
 }
 
-void INI::ExpandVariables(dictionary* ini)
+// Changes the launcher's environment. Values are expanded as they are read,
+// so those still waiting that refer to %name% are expanded first to see the
+// value it had when the INI was loaded. Other values stay pending.
+void INI::SetEnvironment(dictionary* ini, LPCSTR name, LPCSTR value)
 {
-	char tmp[4096];
-	for(int i = 0; i < ini->size; i++) {
-		char* key = ini->key[i];
-		char* value = ini->val[i];
-		int size = ExpandEnvironmentStrings(value, tmp, 4096);
-		if(size == 0) {
-			Log::Warning("Could not expand variable: %s", value);
+	int len = strlen(name);
+	for(int i = 0; ini->expand != NULL && i < ini->last; i++) {
+		if(ini->key[i] == NULL || !(ini->flags[i] & DICT_EXPAND))
+			continue;
+		// Variable names are not case sensitive
+		for(const char* p = strchr(ini->val[i], '%'); p; p = strchr(p + 1, '%')) {
+			if(_strnicmp(p + 1, name, len) == 0 && p[len + 1] == '%') {
+				dictionary_getval(ini, i);
+				break;
+			}
 		}
-		iniparser_setstr(ini, key, tmp);
 	}
+	SetEnvironmentVariable(name, value);
 }
 
-extern "C" __declspec(dllexport) dictionary* __cdecl INI_GetDictionary()
+// Swaps in a fully expanded copy of the INI. Only the launcher thread publishes,
+// readers see either the old or the new snapshot and never wait.
+void INI::Publish(dictionary* ini)
 {
+	// Nothing is expanded on read once published, so ini is also safe to share.
+	// This expands whatever is still pending, so on a launch deferring only
+	// saves the work for the built-in commands and the paths that exit early.
+	ExpandAll(ini);
+	dictionary* snapshot = dictionary_copy(ini);
+	dictionary* old = (dictionary*) InterlockedExchangePointer((PVOID volatile*) &g_snapshot, snapshot);
+	if(old) {
+		g_retired = (dictionary**) realloc(g_retired, (g_retiredCount + 1) * sizeof(dictionary*));
+		g_retired[g_retiredCount++] = old;
+	}
+}
+
+dictionary* INI::GetPublished()
+{
+	// Before the first publish there is only the launcher thread. Only the
+	// first call expands anything, ExpandAll returns at once after that.
+	dictionary* snapshot = g_snapshot;
+	if(snapshot)
+		return snapshot;
+	if(g_ini)
+		ExpandAll(g_ini);
 	return g_ini;
 }
 
+extern "C" __declspec(dllexport) dictionary* __cdecl INI_GetDictionary()
+{
+	return INI::GetPublished();
+}
+
 extern "C" __declspec(dllexport) const char* __cdecl INI_GetProperty(const char* key)
 {
-	return iniparser_getstr(g_ini, key);
+	return iniparser_getstr(INI::GetPublished(), key);
 }
 
 
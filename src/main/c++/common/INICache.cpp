@@ -0,0 +1,311 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#include "common/INICache.h"
+#include "common/INI.h"
+#include "common/Log.h"
+
+#define CACHE_MAGIC   MAKEFOURCC('I','N','I','C')
+#define CACHE_VERSION 1
+
+#define INPUT_FILE     0
+#define INPUT_REGISTRY 1
+#define INPUT_ENV      2
+
+// A missing file, key or variable
+#define STAMP_MISSING ((ULONGLONG) -1)
+
+typedef struct {
+	DWORD magic;
+	DWORD version;
+	DWORD inputs;
+	DWORD entries;
+	DWORD size;   // bytes following the header
+} CacheHeader;
+
+typedef struct {
+	DWORD type;
+	char* name;
+	ULONGLONG stamp;
+	ULONGLONG size;
+} CacheInput;
+
+namespace
+{
+	CacheInput* g_inputs = NULL;
+	int g_inputCount = 0;
+	int g_inputSize = 0;
+}
+
+void INICache::GetCacheFile(LPCSTR inifile, LPSTR cachefile)
+{
+	_snprintf(cachefile, MAX_PATH, "%s.cache", inifile);
+	cachefile[MAX_PATH - 1] = 0;
+}
+
+static ULONGLONG FileTimeStamp(FILETIME& ft)
+{
+	return (((ULONGLONG) ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+}
+
+bool INICache::GetStamp(DWORD type, LPCSTR name, ULONGLONG& stamp, ULONGLONG& size)
+{
+	if(type == INPUT_FILE) {
+		WIN32_FILE_ATTRIBUTE_DATA fad;
+		if(!GetFileAttributesEx(name, GetFileExInfoStandard, &fad)) {
+			stamp = size = STAMP_MISSING;
+		} else {
+			stamp = FileTimeStamp(fad.ftLastWriteTime);
+			size = (((ULONGLONG) fad.nFileSizeHigh) << 32) | fad.nFileSizeLow;
+		}
+		return true;
+	}
+
+	if(type == INPUT_REGISTRY) {
+		// size holds the access flags the key was opened with
+		stamp = STAMP_MISSING;
+		const char* slash = strchr(name, '\\');
+		if(slash == NULL || slash - name >= MAX_PATH)
+			return true;
+		char rootKey[MAX_PATH];
+		memcpy(rootKey, name, slash - name);
+		rootKey[slash - name] = 0;
+		HKEY hKey = INI::GetHKey(rootKey);
+		HKEY subKey;
+		if(hKey && RegOpenKeyEx(hKey, slash + 1, 0, (REGSAM) size, &subKey) == ERROR_SUCCESS) {
+			FILETIME ft;
+			if(RegQueryInfoKey(subKey, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &ft) == ERROR_SUCCESS)
+				stamp = FileTimeStamp(ft);
+			RegCloseKey(subKey);
+		}
+		return true;
+	}
+
+	if(type == INPUT_ENV) {
+		char value[4096];
+		DWORD len = GetEnvironmentVariable(name, value, sizeof(value));
+		if(len == 0 && GetLastError() == ERROR_ENVVAR_NOT_FOUND) {
+			stamp = size = STAMP_MISSING;
+		} else if(len >= sizeof(value)) {
+			char* large = (char*) malloc(len);
+			len = GetEnvironmentVariable(name, large, len);
+			stamp = dictionary_hashn(large, len);
+			size = len;
+			free(large);
+		} else {
+			stamp = dictionary_hashn(value, len);
+			size = len;
+		}
+		return true;
+	}
+
+	return false;
+}
+
+void INICache::AddInput(DWORD type, LPCSTR name, int len, ULONGLONG stamp, ULONGLONG size)
+{
+	for(int i = 0; i < g_inputCount; i++) {
+		if(g_inputs[i].type == type && strncmp(g_inputs[i].name, name, len) == 0 && g_inputs[i].name[len] == 0)
+			return;
+	}
+	if(g_inputCount == g_inputSize) {
+		g_inputSize = g_inputSize ? g_inputSize * 2 : 16;
+		g_inputs = (CacheInput*) realloc(g_inputs, g_inputSize * sizeof(CacheInput));
+	}
+	CacheInput* in = &g_inputs[g_inputCount++];
+	in->type = type;
+	in->name = (char*) malloc(len + 1);
+	memcpy(in->name, name, len);
+	in->name[len] = 0;
+	in->size = size;
+	GetStamp(type, in->name, in->stamp, in->size);
+}
+
+void INICache::Reset()
+{
+	for(int i = 0; i < g_inputCount; i++)
+		free(g_inputs[i].name);
+	g_inputCount = 0;
+}
+
+void INICache::AddFile(LPCSTR filename)
+{
+	if(filename)
+		AddInput(INPUT_FILE, filename, strlen(filename), 0, 0);
+}
+
+void INICache::AddRegistryKey(LPCSTR location, REGSAM sam)
+{
+	if(location)
+		AddInput(INPUT_REGISTRY, location, strlen(location), 0, sam);
+}
+
+void INICache::AddEnvironment(LPCSTR name, int len)
+{
+	if(len > 0)
+		AddInput(INPUT_ENV, name, len, 0, 0);
+}
+
+// Restores the snapshot with one read into an arena block of the new dictionary
+// so the keys and values are used in place.
+dictionary* INICache::Load(LPCSTR inifile, bool& stale)
+{
+	stale = false;
+	char cachefile[MAX_PATH];
+	GetCacheFile(inifile, cachefile);
+	HANDLE h = CreateFile(cachefile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if(h == INVALID_HANDLE_VALUE)
+		return NULL;
+
+	CacheHeader hdr;
+	DWORD read = 0;
+	DWORD fileSize = GetFileSize(h, NULL);
+	if(!ReadFile(h, &hdr, sizeof(hdr), &read, NULL) || read != sizeof(hdr) ||
+		hdr.magic != CACHE_MAGIC || hdr.version != CACHE_VERSION ||
+		fileSize == INVALID_FILE_SIZE || hdr.size != fileSize - sizeof(hdr)) {
+		CloseHandle(h);
+		stale = true;
+		return NULL;
+	}
+
+	dictionary* ini = dictionary_new(hdr.entries < 128 ? 128 : hdr.entries, true);
+	char* p = dictionary_alloc(ini, hdr.size + 1);
+	BOOL ok = ReadFile(h, p, hdr.size, &read, NULL) && read == hdr.size;
+	CloseHandle(h);
+	char* end = p + hdr.size;
+	*end = 0;
+
+	// Check every recorded input is unchanged
+	for(DWORD i = 0; ok && i < hdr.inputs; i++) {
+		CacheInput in;
+		if(end - p < sizeof(DWORD) + 2 * sizeof(ULONGLONG)) {
+			ok = false;
+			break;
+		}
+		memcpy(&in.type, p, sizeof(DWORD));
+		memcpy(&in.stamp, p + sizeof(DWORD), sizeof(ULONGLONG));
+		memcpy(&in.size, p + sizeof(DWORD) + sizeof(ULONGLONG), sizeof(ULONGLONG));
+		p += sizeof(DWORD) + 2 * sizeof(ULONGLONG);
+		in.name = p;
+		p += strlen(p) + 1;
+		ULONGLONG stamp, size = in.size;
+		if(p > end || !GetStamp(in.type, in.name, stamp, size) || stamp != in.stamp || size != in.size) {
+			Log::Info("INI cache out of date: %s", p > end ? cachefile : in.name);
+			ok = false;
+		}
+	}
+
+	// Adopt the entries
+	for(DWORD i = 0; ok && i < hdr.entries; i++) {
+		char* key = p;
+		int keylen = strlen(key);
+		p += keylen + 1;
+		if(p >= end) {
+			ok = false;
+			break;
+		}
+		char* value = NULL;
+		if(*p++) {
+			value = p;
+			p += strlen(p) + 1;
+		}
+		if(p > end) {
+			ok = false;
+			break;
+		}
+		dictionary_setref(ini, key, keylen, value);
+	}
+
+	if(!ok) {
+		dictionary_del(ini);
+		stale = true;
+		return NULL;
+	}
+
+	return ini;
+}
+
+bool INICache::Save(dictionary* ini, LPCSTR inifile)
+{
+	CacheHeader hdr;
+	hdr.magic = CACHE_MAGIC;
+	hdr.version = CACHE_VERSION;
+	hdr.inputs = g_inputCount;
+	hdr.entries = 0;
+	hdr.size = 0;
+	for(int i = 0; i < g_inputCount; i++)
+		hdr.size += sizeof(DWORD) + 2 * sizeof(ULONGLONG) + strlen(g_inputs[i].name) + 1;
+	for(int i = 0; i < ini->last; i++) {
+		if(ini->key[i] == NULL)
+			continue;
+		hdr.entries++;
+		hdr.size += strlen(ini->key[i]) + 2;
+		if(ini->val[i])
+			hdr.size += strlen(ini->val[i]) + 1;
+	}
+
+	char* buf = (char*) malloc(sizeof(hdr) + hdr.size);
+	char* p = buf;
+	memcpy(p, &hdr, sizeof(hdr));
+	p += sizeof(hdr);
+	for(int i = 0; i < g_inputCount; i++) {
+		CacheInput* in = &g_inputs[i];
+		memcpy(p, &in->type, sizeof(DWORD));
+		memcpy(p + sizeof(DWORD), &in->stamp, sizeof(ULONGLONG));
+		memcpy(p + sizeof(DWORD) + sizeof(ULONGLONG), &in->size, sizeof(ULONGLONG));
+		p += sizeof(DWORD) + 2 * sizeof(ULONGLONG);
+		int len = strlen(in->name) + 1;
+		memcpy(p, in->name, len);
+		p += len;
+	}
+	for(int i = 0; i < ini->last; i++) {
+		if(ini->key[i] == NULL)
+			continue;
+		int len = strlen(ini->key[i]) + 1;
+		memcpy(p, ini->key[i], len);
+		p += len;
+		*p++ = ini->val[i] != NULL;
+		if(ini->val[i]) {
+			len = strlen(ini->val[i]) + 1;
+			memcpy(p, ini->val[i], len);
+			p += len;
+		}
+	}
+
+	// Write to a temporary file and swap it in so concurrent launches never
+	// see a partial snapshot
+	char cachefile[MAX_PATH], tmpfile[MAX_PATH];
+	GetCacheFile(inifile, cachefile);
+	_snprintf(tmpfile, MAX_PATH, "%s.%d", cachefile, GetCurrentProcessId());
+	tmpfile[MAX_PATH - 1] = 0;
+	bool ok = false;
+	HANDLE h = CreateFile(tmpfile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(h != INVALID_HANDLE_VALUE) {
+		DWORD written = 0;
+		ok = WriteFile(h, buf, sizeof(hdr) + hdr.size, &written, NULL) && written == sizeof(hdr) + hdr.size;
+		CloseHandle(h);
+		if(ok)
+			ok = MoveFileEx(tmpfile, cachefile, MOVEFILE_REPLACE_EXISTING) != 0;
+		if(!ok)
+			DeleteFile(tmpfile);
+	}
+	free(buf);
+
+	if(!ok)
+		Log::Warning("Could not write INI cache: %s", cachefile);
+	return ok;
+}
+
+void INICache::Delete(LPCSTR inifile)
+{
+	char cachefile[MAX_PATH];
+	GetCacheFile(inifile, cachefile);
+	DeleteFile(cachefile);
+}
@@ -0,0 +1,214 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#include "common/Profile.h"
+#include "common/Log.h"
+#include <stdio.h>
+
+#define MAX_PROFILE_RUNS 1000
+
+static const char* g_phaseNames[PROFILE_PHASES] = {
+	"command.line",
+	"ini",
+	"ini.cache",
+	"ini.parse",
+	"ini.merge",
+	"ini.env",
+	"ini.registry",
+	"classpath",
+	"vm.find",
+	"vm.runtime",
+	"vm.load",
+	"vm.wait",
+	"vm.create",
+	"jni.init",
+	"classloader",
+	"main.class",
+};
+
+namespace
+{
+	LARGE_INTEGER g_frequency;
+	LONGLONG g_start;
+	LONGLONG g_ticks[PROFILE_PHASES];
+	bool g_reported = false;
+}
+
+void Profile::Init()
+{
+	QueryPerformanceFrequency(&g_frequency);
+	g_start = Start();
+}
+
+LONGLONG Profile::Start()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+void Profile::End(ProfilePhase phase, LONGLONG start)
+{
+	// Lookups made by the VM's threads after startup are not counted
+	if(!g_reported)
+		g_ticks[phase] += Start() - start;
+}
+
+double Profile::ToMillis(LONGLONG ticks)
+{
+	return g_frequency.QuadPart ? ticks * 1000.0 / g_frequency.QuadPart : 0;
+}
+
+bool Profile::WriteJSON(LPCSTR file, LONGLONG total)
+{
+	char json[2048];
+	int len = _snprintf(json, sizeof(json), "{\"total\":%.3f,\"phases\":{", ToMillis(total));
+	for(int i = 0; i < PROFILE_PHASES; i++)
+		len += _snprintf(&json[len], sizeof(json) - len, "%s\"%s\":%.3f", i ? "," : "", g_phaseNames[i], ToMillis(g_ticks[i]));
+	len += _snprintf(&json[len], sizeof(json) - len, "}}\n");
+
+	HANDLE h = CreateFile(file, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(h == INVALID_HANDLE_VALUE)
+		return false;
+	DWORD written = 0;
+	bool ok = WriteFile(h, json, len, &written, NULL) && written == (DWORD) len;
+	CloseHandle(h);
+	return ok;
+}
+
+// Reads back a profile written by WriteJSON, total is the last time
+bool Profile::ReadJSON(LPCSTR file, double* times)
+{
+	HANDLE h = CreateFile(file, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if(h == INVALID_HANDLE_VALUE)
+		return false;
+	char json[2048];
+	DWORD read = 0;
+	ReadFile(h, json, sizeof(json) - 1, &read, NULL);
+	CloseHandle(h);
+	json[read] = 0;
+
+	char key[MAX_PATH];
+	for(int i = 0; i <= PROFILE_PHASES; i++) {
+		_snprintf(key, MAX_PATH, "\"%s\":", i < PROFILE_PHASES ? g_phaseNames[i] : "total");
+		char* value = strstr(json, key);
+		if(!value)
+			return false;
+		times[i] = atof(value + strlen(key));
+	}
+	return true;
+}
+
+bool Profile::Report(dictionary* ini)
+{
+	if(g_reported)
+		return false;
+	LONGLONG total = Start() - g_start;
+	g_reported = true;
+
+	char line[MAX_LOG_LENGTH - 100];
+	int len = _snprintf(line, sizeof(line), "total=%.2f", ToMillis(total));
+	for(int i = 0; i < PROFILE_PHASES; i++)
+		len += _snprintf(&line[len], sizeof(line) - len, " %s=%.2f", g_phaseNames[i], ToMillis(g_ticks[i]));
+	Log::Info("Startup profile (ms): %s", line);
+
+	char env[MAX_PATH];
+	DWORD envLen = GetEnvironmentVariable(STARTUP_PROFILE_ENV, env, MAX_PATH);
+	bool profiling = envLen > 0 && envLen < MAX_PATH;
+	char* file = profiling ? env : iniparser_getstr(ini, STARTUP_PROFILE);
+	if(file && !WriteJSON(file, total))
+		Log::Warning("Could not write startup profile: %s", file);
+	return profiling;
+}
+
+static int CompareTimes(const void* a, const void* b)
+{
+	double d = *(const double*) a - *(const double*) b;
+	return d < 0 ? -1 : d > 0 ? 1 : 0;
+}
+
+// Nearest rank percentile of sorted times
+static double Percentile(double* sorted, int count, int p)
+{
+	int rank = (p * count + 99) / 100;
+	return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+int Profile::Run(int runs, TCHAR** args, UINT argCount)
+{
+	if(runs < 1 || runs > MAX_PROFILE_RUNS) {
+		Log::Error("Number of runs must be between 1 and %d", MAX_PROFILE_RUNS);
+		return 1;
+	}
+
+	// Quote the arguments again for the launches' command line
+	TCHAR module[MAX_PATH];
+	GetModuleFileName(NULL, module, MAX_PATH);
+	int len = strlen(module) + 3;
+	for(UINT i = 0; i < argCount; i++)
+		len += strlen(args[i]) + 3;
+	char* cmdline = (char*) malloc(len + 1);
+	sprintf(cmdline, "\"%s\"", module);
+	for(UINT i = 0; i < argCount; i++) {
+		strcat(cmdline, " \"");
+		strcat(cmdline, args[i]);
+		strcat(cmdline, "\"");
+	}
+
+	TCHAR tempDir[MAX_PATH], file[MAX_PATH];
+	GetTempPath(MAX_PATH, tempDir);
+	GetTempFileName(tempDir, "wr4", 0, file);
+	SetEnvironmentVariable(STARTUP_PROFILE_ENV, file);
+
+	int columns = PROFILE_PHASES + 1;
+	double* times = (double*) malloc(runs * columns * sizeof(double));
+	int completed = 0;
+	for(int i = 0; i < runs; i++) {
+		DeleteFile(file);
+		STARTUPINFO si;
+		PROCESS_INFORMATION pi;
+		ZeroMemory(&si, sizeof(si));
+		si.cb = sizeof(si);
+		if(!CreateProcess(module, cmdline, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi)) {
+			Log::Error("Could not launch %s", module);
+			break;
+		}
+		WaitForSingleObject(pi.hProcess, INFINITE);
+		CloseHandle(pi.hThread);
+		CloseHandle(pi.hProcess);
+		if(ReadJSON(file, &times[completed * columns]))
+			completed++;
+		else
+			Log::Warning("Launch %d did not report a startup profile", i + 1);
+	}
+	DeleteFile(file);
+	SetEnvironmentVariable(STARTUP_PROFILE_ENV, NULL);
+	free(cmdline);
+
+	if(completed == 0) {
+		free(times);
+		return 1;
+	}
+
+	printf("Startup profile of %d launches (ms)\n", completed);
+	printf("%-14s %9s %9s %9s %9s %9s\n", "phase", "min", "p50", "p90", "p99", "max");
+	double* sorted = (double*) malloc(completed * sizeof(double));
+	for(int c = 0; c < columns; c++) {
+		for(int i = 0; i < completed; i++)
+			sorted[i] = times[i * columns + c];
+		qsort(sorted, completed, sizeof(double), CompareTimes);
+		printf("%-14s %9.2f %9.2f %9.2f %9.2f %9.2f\n", c < PROFILE_PHASES ? g_phaseNames[c] : "total",
+			sorted[0], Percentile(sorted, completed, 50), Percentile(sorted, completed, 90),
+			Percentile(sorted, completed, 99), sorted[completed - 1]);
+	}
+	free(sorted);
+	free(times);
+	return 0;
+}
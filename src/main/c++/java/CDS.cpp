@@ -0,0 +1,161 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#include "java/CDS.h"
+#include "java/Classpath.h"
+#include "java/VMDiscovery.h"
+#include "common/Directory.h"
+#include "common/Log.h"
+
+#define CDS_ARCHIVE_AT_EXIT "-XX:ArchiveClassesAtExit="
+#define CDS_ARCHIVE_FILE    "-XX:SharedArchiveFile="
+#define CDS_AUTO_CREATE     "-XX:+AutoCreateSharedArchive"
+
+// Dynamic archives arrived in Java 13, Java 19 can maintain them itself
+#define CDS_MIN_VERSION  13
+#define CDS_AUTO_VERSION 19
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME  1099511628211ULL
+
+static ULONGLONG HashBytes(ULONGLONG hash, const void* data, int len)
+{
+	const BYTE* p = (const BYTE*) data;
+	for(int i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+static LPSTR MakeArg(LPCSTR prefix, LPCSTR value)
+{
+	LPSTR arg = (LPSTR) malloc(strlen(prefix) + strlen(value) + 1);
+	strcpy(arg, prefix);
+	strcat(arg, value);
+	return arg;
+}
+
+// Reads JAVA_VERSION from the release file of the VM's home, returning the
+// feature version (8 for 1.8.0_x) or 0 if it cannot be found
+int CDS::GetJavaVersion(LPSTR vmlibrary, LPSTR version, int size)
+{
+	if(!VMDiscovery::GetReleaseValue(vmlibrary, "JAVA_VERSION", version, size))
+		return 0;
+	return StartsWith(version, "1.") ? atoi(&version[2]) : atoi(version);
+}
+
+// Removes archives of other classpaths or VMs, and finishes any archive of
+// this one that an earlier launch wrote under its own name. Archives still
+// in use by a running VM cannot be deleted or renamed and are left alone.
+void CDS::RemoveStale(LPCSTR dir, LPCSTR name, LPCSTR archive)
+{
+	char pattern[MAX_PATH];
+	_snprintf(pattern, MAX_PATH, "%s.*.jsa", name);
+	pattern[MAX_PATH - 1] = 0;
+	const char* archiveName = strrchr(archive, '\\') + 1;
+	int keyLen = strlen(archiveName) - strlen(".jsa");
+
+	DirEntry* entries;
+	int count = Directory::List(dir, pattern, &entries);
+	bool exists = Directory::Exists(archive);
+	for(int i = 0; i < count; i++) {
+		if(entries[i].isDir || _stricmp(entries[i].name, archiveName) == 0)
+			continue;
+		char path[MAX_PATH];
+		_snprintf(path, MAX_PATH, "%s\\%s", dir, entries[i].name);
+		path[MAX_PATH - 1] = 0;
+		if(!exists && _strnicmp(entries[i].name, archiveName, keyLen) == 0 && entries[i].name[keyLen] == '.') {
+			if(MoveFile(path, archive)) {
+				Log::Info("Created CDS archive: %s", archive);
+				exists = true;
+			}
+		} else if(DeleteFile(path)) {
+			Log::Info("Removed stale CDS archive: %s", path);
+		}
+	}
+	Directory::Free(entries, count);
+}
+
+void CDS::AddArgs(dictionary* ini, LPSTR vmlibrary, TCHAR** args, UINT& count)
+{
+	char* mode = iniparser_getstr(ini, VM_CDS);
+	if(mode == NULL || _stricmp(mode, "off") == 0)
+		return;
+	if(_stricmp(mode, "auto") != 0) {
+		Log::Warning("Unknown vm.cds mode: %s", mode);
+		return;
+	}
+
+	char version[MAX_PATH];
+	int feature = GetJavaVersion(vmlibrary, version, MAX_PATH);
+	if(feature < CDS_MIN_VERSION) {
+		Log::Info("CDS archives need Java %d or later, found %s", CDS_MIN_VERSION, feature ? version : "unknown version");
+		return;
+	}
+
+	// Key the archive on the VM build and the classpath
+	ULONGLONG hash = FNV_OFFSET;
+	hash = HashBytes(hash, version, strlen(version));
+	hash = HashBytes(hash, vmlibrary, strlen(vmlibrary));
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+	if(GetFileAttributesEx(vmlibrary, GetFileExInfoStandard, &fad)) {
+		hash = HashBytes(hash, &fad.ftLastWriteTime, sizeof(fad.ftLastWriteTime));
+		hash = HashBytes(hash, &fad.nFileSizeLow, sizeof(fad.nFileSizeLow));
+	}
+	for(UINT i = 0; i < count; i++) {
+		if(StartsWith(args[i], CLASS_PATH_ARG))
+			hash = HashBytes(hash, args[i], strlen(args[i]));
+	}
+
+	// Archives are named after the INI file and kept next to it unless a
+	// directory is given
+	char* inifile = iniparser_getstr(ini, MODULE_INI);
+	const char* sep = inifile ? strrchr(inifile, '\\') : NULL;
+	if(sep == NULL)
+		return;
+	const char* name = sep + 1;
+	char dir[MAX_PATH];
+	char* cdsDir = iniparser_getstr(ini, VM_CDS_DIR);
+	if(cdsDir) {
+		CreateDirectory(cdsDir, NULL);
+		GetFullPathName(cdsDir, MAX_PATH, dir, NULL);
+	} else {
+		strncpy(dir, inifile, MAX_PATH);
+		dir[sep - inifile] = 0;
+	}
+	char archive[MAX_PATH];
+	_snprintf(archive, MAX_PATH, "%s\\%s.%016I64x.jsa", dir, name, hash);
+	archive[MAX_PATH - 1] = 0;
+
+	RemoveStale(dir, name, archive);
+
+	if(feature >= CDS_AUTO_VERSION) {
+		Log::Info("Using CDS archive: %s", archive);
+		args[count++] = _strdup(CDS_AUTO_CREATE);
+		args[count++] = MakeArg(CDS_ARCHIVE_FILE, archive);
+		return;
+	}
+
+	if(Directory::Exists(archive)) {
+		Log::Info("CDS archive hit: %s", archive);
+		args[count++] = MakeArg(CDS_ARCHIVE_FILE, archive);
+		return;
+	}
+
+	// The VM writes the archive as it exits, which may be some time later and
+	// race with other launches, so it writes to a name of its own which the
+	// next launch renames
+	char pending[MAX_PATH];
+	_snprintf(pending, MAX_PATH, "%.*s.%d.jsa", (int) (strlen(archive) - strlen(".jsa")), archive, GetCurrentProcessId());
+	pending[MAX_PATH - 1] = 0;
+	Log::Info("CDS archive miss, archiving classes at exit to: %s", pending);
+	args[count++] = MakeArg(CDS_ARCHIVE_AT_EXIT, pending);
+}
@@ -11,87 +11,446 @@
 #include "java\Classpath.h"
 #include "common/Log.h"
 #include "common/Dictionary.h"
+#include "common/Directory.h"
+#include "common/Glob.h"
+#include "java/ClasspathCache.h"
 
-namespace 
+#define CLASSPATH_THREADS  ":classpath.threads"
+#define CLASSPATH_VALIDATE ":classpath.validate"
+#define DEFAULT_THREADS    4
+
+// End of central directory record, at the end of a zip before its comment
+#define ZIP_EOCD_SIZE      22
+#define ZIP_MAX_COMMENT    0xFFFF
+#define ZIP64_MARKER       0xFFFFFFFF
+
+// A directory being expanded against the rest of a pattern. Matches become
+// children so the result can be read back in the same order however the work
+// was scheduled.
+typedef struct _ExpandNode {
+	char* path;                    // directory to expand, then the expanded path (or NULL)
+	struct _ExpandNode* children;  // matches in directory order
+	int childCount;
+	GlobPattern* glob;
+	int part;                      // first part of glob still to match
+	const char* dropped;           // why the expanded path is left out (or NULL)
+} ExpandNode;
+
+// Tasks of one worker, the owner works from the tail and others steal from the head
+typedef struct {
+	CRITICAL_SECTION lock;
+	ExpandNode** tasks;
+	int head;
+	int tail;
+	int size;
+} ExpandQueue;
+
+typedef struct {
+	ExpandQueue* queues;
+	int count;
+	volatile LONG pending;
+	GlobPattern** excludes;
+	int excludeCount;
+	bool validate;
+} ExpandPool;
+
+typedef struct {
+	ExpandPool* pool;
+	int id;
+} ExpandWorker;
+
+static void PushTask(ExpandPool* pool, int id, ExpandNode* node)
+{
+	ExpandQueue* q = &pool->queues[id];
+	InterlockedIncrement(&pool->pending);
+	EnterCriticalSection(&q->lock);
+	if(q->tail == q->size && q->head > 0) {
+		// Reclaim the stolen slots at the front before growing
+		memmove(q->tasks, &q->tasks[q->head], (q->tail - q->head) * sizeof(ExpandNode*));
+		q->tail -= q->head;
+		q->head = 0;
+	}
+	if(q->tail == q->size) {
+		q->size = q->size ? q->size * 2 : 64;
+		q->tasks = (ExpandNode**) realloc(q->tasks, q->size * sizeof(ExpandNode*));
+	}
+	q->tasks[q->tail++] = node;
+	LeaveCriticalSection(&q->lock);
+}
+
+static ExpandNode* TakeTask(ExpandPool* pool, int id)
+{
+	ExpandNode* node = NULL;
+	for(int i = 0; i < pool->count && node == NULL; i++) {
+		ExpandQueue* q = &pool->queues[(id + i) % pool->count];
+		EnterCriticalSection(&q->lock);
+		if(q->head < q->tail)
+			node = i == 0 ? q->tasks[--q->tail] : q->tasks[q->head++];
+		LeaveCriticalSection(&q->lock);
+	}
+	return node;
+}
+
+static char* JoinPath(const char* dir, const char* name)
+{
+	int dlen = strlen(dir);
+	int nlen = strlen(name);
+	char* path = (char*) malloc(dlen + nlen + 2);
+	memcpy(path, dir, dlen);
+	path[dlen] = '\\';
+	memcpy(&path[dlen + 1], name, nlen + 1);
+	return path;
+}
+
+// Reason given for entries matching classpath.exclude, which are not warned about
+static const char DroppedExcluded[] = "excluded";
+
+static bool IsExcluded(ExpandPool* pool, const char* path)
+{
+	for(int i = 0; i < pool->excludeCount; i++) {
+		if(Glob::Match(pool->excludes[i], path))
+			return true;
+	}
+	return false;
+}
+
+static DWORD ReadZipInt(const BYTE* p)
 {
-	bool g_classpathMaxWarned = false;
-};
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((DWORD) p[3] << 24);
+}
 
-void ExpandClassPathEntry(char* arg, char** result, int* current, int max)
+// Looks for the end of central directory record in the tail of a jar. Only
+// the tail is mapped, from the allocation granularity boundary below it.
+static const char* CheckArchive(const char* path)
 {
-	// Check for too many results
-	if(*current >= max) {
-		if(!g_classpathMaxWarned) {
-			Log::Warning("Exceeded maximum classpath size");
-			g_classpathMaxWarned = true;
+	HANDLE h = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(h == INVALID_HANDLE_VALUE)
+		return "cannot be opened";
+	LARGE_INTEGER size;
+	if(!GetFileSizeEx(h, &size) || size.QuadPart < ZIP_EOCD_SIZE) {
+		CloseHandle(h);
+		return "not a zip file";
+	}
+
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	ULONGLONG fileSize = size.QuadPart;
+	ULONGLONG tail = fileSize < ZIP_EOCD_SIZE + ZIP_MAX_COMMENT ? fileSize : ZIP_EOCD_SIZE + ZIP_MAX_COMMENT;
+	ULONGLONG offset = (fileSize - tail) / si.dwAllocationGranularity * si.dwAllocationGranularity;
+	HANDLE mapping = CreateFileMapping(h, NULL, PAGE_READONLY, 0, 0, NULL);
+	BYTE* view = mapping ? (BYTE*) MapViewOfFile(mapping, FILE_MAP_READ, (DWORD) (offset >> 32), (DWORD) offset, (SIZE_T) (fileSize - offset)) : NULL;
+	const char* reason = view ? "not a zip file or truncated" : "cannot be mapped";
+	if(view) {
+		// Scan back from the end, the record is followed by its comment
+		BYTE* end = view + (fileSize - offset);
+		for(BYTE* p = end - ZIP_EOCD_SIZE; p >= end - tail; p--) {
+			if(p[0] != 'P' || p[1] != 'K' || p[2] != 5 || p[3] != 6)
+				continue;
+			int commentLen = p[20] | (p[21] << 8);
+			if(p + ZIP_EOCD_SIZE + commentLen > end)
+				continue;
+			int entries = p[10] | (p[11] << 8);
+			DWORD cdSize = ReadZipInt(&p[12]);
+			DWORD cdOffset = ReadZipInt(&p[16]);
+			ULONGLONG eocdOffset = offset + (p - view);
+			if(cdOffset != ZIP64_MARKER && (ULONGLONG) cdOffset + cdSize > eocdOffset)
+				reason = "central directory is past the end of the file";
+			else if(entries == 0 && cdSize == 0)
+				reason = "empty zip file";
+			else
+				reason = NULL;
+			break;
+		}
+		UnmapViewOfFile(view);
+	}
+	if(mapping)
+		CloseHandle(mapping);
+	CloseHandle(h);
+	return reason;
+}
+
+static bool IsArchive(const char* path)
+{
+	int len = strlen(path);
+	return len > 4 && (_stricmp(&path[len - 4], ".jar") == 0 || _stricmp(&path[len - 4], ".zip") == 0);
+}
+
+// Returns why an expanded path should be left out of the classpath, or NULL.
+// Only jars and zips are checked, other files (resources a wildcard matched)
+// are kept as they always were.
+static const char* CheckEntry(ExpandPool* pool, const char* path, bool isDir)
+{
+	if(IsExcluded(pool, path))
+		return DroppedExcluded;
+	if(!pool->validate)
+		return NULL;
+	if(isDir)
+		return Directory::IsEmpty(path) ? "empty directory" : NULL;
+	return IsArchive(path) ? CheckArchive(path) : NULL;
+}
+
+// Adds a match below node, either a final path or a directory to expand further
+static void AddMatch(ExpandPool* pool, ExpandNode* node, DirEntry* entry, int part)
+{
+	ExpandNode* child = &node->children[node->childCount++];
+	child->path = JoinPath(node->path, entry->name);
+	if(part < node->glob->partCount) {
+		child->glob = node->glob;
+		child->part = part;
+	} else {
+		child->dropped = CheckEntry(pool, child->path, entry->isDir);
+	}
+}
+
+// Matches the listing of node against part i of its pattern. A ** part first
+// matches no directories, then descends into each subdirectory (but not into
+// links, which could loop). A trailing ** matches every file below.
+static void MatchEntries(ExpandPool* pool, ExpandNode* node, int i, DirEntry* entries, int count)
+{
+	GlobPattern* glob = node->glob;
+	GlobPart* part = &glob->parts[i];
+	bool last = i + 1 == glob->partCount;
+	if(part->type == GLOB_ANYDIRS) {
+		if(!last)
+			MatchEntries(pool, node, i + 1, entries, count);
+		for(int j = 0; j < count; j++) {
+			if(entries[j].isDir && !entries[j].isLink)
+				AddMatch(pool, node, &entries[j], i);
+			else if(last && !entries[j].isDir)
+				AddMatch(pool, node, &entries[j], i + 1);
 		}
 		return;
 	}
+	for(int j = 0; j < count; j++) {
+		if((last || entries[j].isDir) && Glob::MatchPart(part, entries[j].name))
+			AddMatch(pool, node, &entries[j], i + 1);
+	}
+}
 
-	Log::Info("Expanding Classpath: %s", arg);
+// Expands one directory against its pattern, queueing a child task for each
+// subdirectory that still has parts to match
+static void ExpandTask(ExpandPool* pool, int id, ExpandNode* node)
+{
+	GlobPattern* glob = node->glob;
+	char* dir = node->path;
 
-	// Convert to full path
-	char fullpath[MAX_PATH];
-	GetFullPathName(arg, MAX_PATH, fullpath, NULL);
-	WIN32_FIND_DATA fd;
-
-	// Check for special case - where we don't have a wildcard
-	if(strchr(arg, '*') == NULL) {
-		if(FindFirstFile(fullpath, &fd) != INVALID_HANDLE_VALUE) {
-			result[*current] = strdup(fullpath);
-			(*current)++;
+	// Without wildcards in the rest of the pattern there is one path to check.
+	// Only entries given without wildcards are reported when missing.
+	int i = node->part;
+	while(i < glob->partCount && glob->parts[i].type == GLOB_LITERAL)
+		i++;
+	if(i == glob->partCount) {
+		node->path = NULL;
+		for(i = node->part; i < glob->partCount; i++) {
+			char* path = JoinPath(dir, glob->parts[i].text);
+			free(dir);
+			dir = path;
+		}
+		DWORD attrs = GetFileAttributes(dir);
+		if(attrs != INVALID_FILE_ATTRIBUTES) {
+			node->path = dir;
+			node->dropped = CheckEntry(pool, dir, (attrs & FILE_ATTRIBUTE_DIRECTORY) != 0);
+		} else if(glob->partCount == 0) {
+			node->path = dir;
+			node->dropped = "not found";
+		} else {
+			free(dir);
+		}
+		return;
+	}
+
+	// Every directory is listed in full and matched here, ** needs the
+	// subdirectories and it lets the cache share one listing per directory
+	DirEntry* entries;
+	int count = ClasspathCache::List(dir, "*", &entries);
+	if(count > 0) {
+		node->children = (ExpandNode*) calloc(2 * count, sizeof(ExpandNode));
+		MatchEntries(pool, node, node->part, entries, count);
+	}
+	node->path = NULL;
+	free(dir);
+
+	// Queue in reverse so the owner (which pops from the tail) works in order
+	for(int j = node->childCount - 1; j >= 0; j--) {
+		if(node->children[j].glob)
+			PushTask(pool, id, &node->children[j]);
+	}
+}
+
+static void RunWorker(ExpandPool* pool, int id)
+{
+	int idle = 0;
+	for(;;) {
+		ExpandNode* node = TakeTask(pool, id);
+		if(node) {
+			ExpandTask(pool, id, node);
+			InterlockedDecrement(&pool->pending);
+			idle = 0;
+		} else if(pool->pending == 0) {
 			return;
+		} else if(++idle < 64) {
+			SwitchToThread();
+		} else {
+			// Others are blocked on slow listings, back off
+			Sleep(1);
 		}
 	}
+}
 
-	int len = strlen(fullpath);
-	int prev = 0;
-	bool hasStar = false;
-	char search[MAX_PATH];
-	for(int i = 0; i <= len; i++) {
-		if(fullpath[i] == '/' || fullpath[i] == '\\' || fullpath[i] == 0) {
-			if(hasStar) {
-				// Temp set end of string to be current position
-				fullpath[i] = 0;
-				HANDLE h = FindFirstFile(fullpath, &fd);
-				if(h == INVALID_HANDLE_VALUE) {
-					return;
-				} else {
-					if(strcmp(fd.cFileName, ".") != 0 && strcmp(fd.cFileName, "..") != 0) {
-						if(prev != 0) fullpath[prev] = 0;
-						strcpy(search, fullpath);
-						if(prev != 0) fullpath[prev] = '/';
-						strcat(search, "/");
-						strcat(search, fd.cFileName);
-						if(i < len - 1)	{
-							strcat(search, "/");
-							strcat(search, &fullpath[i + 1]);
-						}
-						ExpandClassPathEntry(search, result, current, max);
-					}
-					while(FindNextFile(h, &fd) != 0) {
-						if(strcmp(fd.cFileName, ".") != 0 && strcmp(fd.cFileName, "..") != 0) {
-							if(prev != 0) fullpath[prev] = 0;
-							strcpy(search, fullpath);
-							if(prev != 0) fullpath[prev] = '/';
-							strcat(search, "/");
-							strcat(search, fd.cFileName);
-							if(i < len - 1)	{
-								strcat(search, "/");
-								strcat(search, &fullpath[i + 1]);
-							}
-							ExpandClassPathEntry(search, result, current, max);
-						}
-					}
-					return;
-				}
-			} 
-			hasStar = false;
-			prev = i;
-		} else if(fullpath[i] == '*') {
-			hasStar = true;
+static DWORD WINAPI ExpandThreadProc(LPVOID param)
+{
+	ExpandWorker* worker = (ExpandWorker*) param;
+	RunWorker(worker->pool, worker->id);
+	return 0;
+}
+
+// Puts path in canonical form: absolute, long names, backslashes and no
+// trailing separator. The key it is compared by is also lower case.
+static char* CanonicalPath(const char* path, char* key, int size)
+{
+	char full[MAX_PATH];
+	if(!GetFullPathName(path, MAX_PATH, full, NULL))
+		strncpy(full, path, MAX_PATH);
+	full[MAX_PATH - 1] = 0;
+	if(strchr(full, '~') == NULL || !GetLongPathName(full, key, size))
+		strncpy(key, full, size);
+	key[size - 1] = 0;
+	int len = strlen(key);
+	if(len > 3 && key[len - 1] == '\\')
+		key[--len] = 0;
+	char* canonical = strdup(key);
+	CharLowerBuff(key, len);
+	return canonical;
+}
+
+// Logs and removes dropped entries and any entry that appeared earlier in
+// the classpath, in classpath order so the first occurrence wins
+static void FilterClassPath(ExpandNode* node, dictionary* seen)
+{
+	if(node->path && node->dropped) {
+		if(node->dropped == DroppedExcluded)
+			Log::Info("Excluding from classpath: %s", node->path);
+		else
+			Log::Warning("Dropping classpath entry %s: %s", node->path, node->dropped);
+		free(node->path);
+		node->path = NULL;
+	} else if(node->path) {
+		char key[MAX_PATH];
+		char* canonical = CanonicalPath(node->path, key, MAX_PATH);
+		free(node->path);
+		node->path = NULL;
+		if(dictionary_get(seen, key, NULL) != NULL) {
+			Log::Info("Dropping classpath entry %s: duplicate", canonical);
+			free(canonical);
+		} else {
+			dictionary_set(seen, key, "");
+			node->path = canonical;
 		}
 	}
+	for(int i = 0; i < node->childCount; i++)
+		FilterClassPath(&node->children[i], seen);
+}
+
+// Length of the expanded paths under node, each followed by a separator
+static int ClassPathLength(ExpandNode* node)
+{
+	int len = node->path ? strlen(node->path) + 1 : 0;
+	for(int i = 0; i < node->childCount; i++)
+		len += ClassPathLength(&node->children[i]);
+	return len;
+}
+
+// Writes the expanded paths in classpath order and frees the tree
+static char* WriteClassPath(ExpandNode* node, char* p)
+{
+	if(node->path) {
+		int len = strlen(node->path);
+		memcpy(p, node->path, len);
+		p[len] = ';';
+		p += len + 1;
+		free(node->path);
+	}
+	for(int i = 0; i < node->childCount; i++)
+		p = WriteClassPath(&node->children[i], p);
+	free(node->children);
+	return p;
+}
+
+// Compiles an entry relative to the current directory. Exclude patterns
+// without a directory match the file name wherever it is.
+static GlobPattern* CompileEntry(const char* entry, bool exclude)
+{
+	if(exclude && strpbrk(entry, "/\\") == NULL) {
+		char* pattern = (char*) malloc(strlen(entry) + 4);
+		strcpy(pattern, "**/");
+		strcat(pattern, entry);
+		GlobPattern* glob = Glob::Compile(pattern);
+		free(pattern);
+		return glob;
+	}
+	char fullpath[MAX_PATH];
+	GetFullPathName(entry, MAX_PATH, fullpath, NULL);
+	return Glob::Compile(fullpath);
+}
+
+// Expands the entries on a small pool of threads, each directory listing is
+// a task that idle threads can steal.
+static ExpandNode* ExpandClassPathEntries(char** args, int argCount, char** excludes, int excludeCount, int threads, bool validate)
+{
+	ExpandNode* roots = (ExpandNode*) calloc(argCount, sizeof(ExpandNode));
+	ExpandPool pool;
+	pool.count = threads;
+	pool.pending = 0;
+	pool.validate = validate;
+	pool.queues = (ExpandQueue*) calloc(threads, sizeof(ExpandQueue));
+	for(int i = 0; i < threads; i++)
+		InitializeCriticalSection(&pool.queues[i].lock);
+
+	// Compile the patterns once up front
+	pool.excludeCount = excludeCount;
+	pool.excludes = (GlobPattern**) malloc(excludeCount * sizeof(GlobPattern*));
+	for(int i = 0; i < excludeCount; i++) {
+		Log::Info("Excluding Classpath: %s", excludes[i]);
+		pool.excludes[i] = CompileEntry(excludes[i], true);
+	}
+	for(int i = argCount - 1; i >= 0; i--) {
+		Log::Info("Expanding Classpath: %s", args[i]);
+		roots[i].glob = CompileEntry(args[i], false);
+		roots[i].path = strdup(roots[i].glob->base);
+		PushTask(&pool, 0, &roots[i]);
+	}
+
+	// This thread is worker 0
+	HANDLE* handles = (HANDLE*) malloc(threads * sizeof(HANDLE));
+	ExpandWorker* workers = (ExpandWorker*) malloc(threads * sizeof(ExpandWorker));
+	int started = 0;
+	for(int i = 1; i < threads; i++) {
+		workers[i].pool = &pool;
+		workers[i].id = i;
+		HANDLE h = CreateThread(0, 0, ExpandThreadProc, &workers[i], 0, 0);
+		if(h)
+			handles[started++] = h;
+	}
+	RunWorker(&pool, 0);
+	if(started) {
+		WaitForMultipleObjects(started, handles, TRUE, INFINITE);
+		for(int i = 0; i < started; i++)
+			CloseHandle(handles[i]);
+	}
+
+	for(int i = 0; i < threads; i++) {
+		DeleteCriticalSection(&pool.queues[i].lock);
+		free(pool.queues[i].tasks);
+	}
+	free(pool.queues);
+	free(workers);
+	free(handles);
+	for(int i = 0; i < excludeCount; i++)
+		Glob::Free(pool.excludes[i]);
+	free(pool.excludes);
+	for(int i = 0; i < argCount; i++)
+		Glob::Free(roots[i].glob);
+	return roots;
 }
 
 // Build up the classpath entry from the ini file list
@@ -106,47 +465,61 @@ void Classpath::BuildClassPath(dictionary* ini, TCHAR** args, UINT& count)
 		SetCurrentDirectory(iniparser_getstr(ini, INI_DIR));
 	}
 
-	TCHAR* entries[MAX_PATH];
-	int i = 0, index = 0;
-	TCHAR* entry = NULL;
-	TCHAR entryName[MAX_PATH];
-	while(true) {
-		sprintf(entryName, "%s.%d", CLASS_PATH, i+1);
-		entry = iniparser_getstr(ini, entryName);
-		if(entry != NULL) {
-			ExpandClassPathEntry(entry, entries, &index, MAX_PATH);
-		}
-		i++;
-		if(i > 10 && entry == NULL) {
+	// Only use extra threads when there are wildcards to expand
+	UINT argCount = 0;
+	TCHAR** cpEntries = INI::GetNumberedKeysFromIni(ini, CLASS_PATH, argCount);
+	UINT excludeCount = 0;
+	TCHAR** excludes = INI::GetNumberedKeysFromIni(ini, CLASS_PATH_EXCLUDE, excludeCount);
+	int threads = 1;
+	for(UINT i = 0; i < argCount; i++) {
+		if(strpbrk(cpEntries[i], "*?[") != NULL) {
+			threads = iniparser_getint(ini, CLASSPATH_THREADS, DEFAULT_THREADS);
 			break;
 		}
 	}
+	if(threads < 1)
+		threads = 1;
 
-	char* classpath = NULL;
-	for(int i = 0; i < index; i++) {
-		char* temp = (char *) malloc(sizeof(TCHAR)*(strlen(entries[i]) + 1) + (classpath == NULL ? 1 : sizeof(TCHAR)*(strlen(classpath) + 2)));
-		temp[0] = 0;
-		if(classpath != NULL) {
-			lstrcat(temp, classpath);
-			lstrcat(temp, ";");
-			free(classpath);
-		}
-		lstrcat(temp, entries[i]);
-		classpath = temp;
-		free(entries[i]);
-	}
+	bool cache = iniparser_getboolean(ini, CLASSPATH_CACHE, 0) != 0;
+	bool validate = iniparser_getboolean(ini, CLASSPATH_VALIDATE, 1) != 0;
+	ClasspathCache::Load(cache ? iniparser_getstr(ini, MODULE_INI) : NULL);
+	ExpandNode* roots = ExpandClassPathEntries(cpEntries, argCount, excludes, excludeCount, threads, validate);
+	ClasspathCache::Save();
+	ClasspathCache::Free();
+	dictionary* seen = dictionary_new(0, true);
+	for(UINT i = 0; i < argCount; i++)
+		FilterClassPath(&roots[i], seen);
+	dictionary_del(seen);
+	for(UINT i = 0; i < argCount; i++)
+		free(cpEntries[i]);
+	free(cpEntries);
+	for(UINT i = 0; i < excludeCount; i++)
+		free(excludes[i]);
+	free(excludes);
+
+	// Size the whole option first and then write it in one go
+	int prefixLen = strlen(CLASS_PATH_ARG);
+	int len = 0;
+	for(UINT i = 0; i < argCount; i++)
+		len += ClassPathLength(&roots[i]);
+	TCHAR* cpArg = (TCHAR *) malloc(sizeof(TCHAR)*(prefixLen + len + 1));
+	memcpy(cpArg, CLASS_PATH_ARG, prefixLen);
+	char* p = &cpArg[prefixLen];
+	for(UINT i = 0; i < argCount; i++)
+		p = WriteClassPath(&roots[i], p);
+	free(roots);
 
-	TCHAR *built = strdup(classpath == NULL ? "" : classpath);
+	// Replace the trailing separator
+	if(p > &cpArg[prefixLen])
+		p--;
+	*p = 0;
 
 	// Produce truncated classpath for logging purposes
 	TCHAR argl[MAX_LOG_LENGTH - 100];
-	StrTruncate(argl, built, MAX_LOG_LENGTH - 100);
+	StrTruncate(argl, &cpArg[prefixLen], MAX_LOG_LENGTH - 100);
 	Log::Info("Generated Classpath: %s", argl);
 
-	// Generate and add classpath arg
-	TCHAR* cpArg = (TCHAR *) malloc(sizeof(TCHAR)*(strlen(built) + 1) + sizeof(TCHAR)*(strlen(CLASS_PATH_ARG) + 1));
-	lstrcpy(cpArg, CLASS_PATH_ARG);
-	lstrcat(cpArg, built);
+	// Add classpath arg
 	args[count++] = cpArg;
 
 	// Now set the working directory back
@@ -0,0 +1,335 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#include "java/ClasspathCache.h"
+#include "common/Dictionary.h"
+#include "common/Log.h"
+
+#define CACHE_MAGIC   MAKEFOURCC('C','P','C','C')
+#define CACHE_VERSION 1
+
+#define ENTRY_DIR  1
+#define ENTRY_LINK 2
+
+typedef struct {
+	DWORD magic;
+	DWORD version;
+	DWORD listings;
+	DWORD size;   // bytes following the header
+} CacheHeader;
+
+typedef struct {
+	unsigned hash;
+	char* dir;
+	char* pattern;
+	ULONGLONG stamp;   // write time of dir when listed, 0 if it is missing
+	DWORD scanUs;      // time taken to list it
+	DirEntry* entries;
+	int count;
+	bool used;
+} Listing;
+
+namespace
+{
+	bool g_enabled = false;
+	char g_cacheFile[MAX_PATH];
+	char* g_buffer = NULL;         // loaded file, cached names point into it
+	Listing* g_cached = NULL;      // sorted on hash
+	int g_cachedCount = 0;
+	Listing* g_fresh = NULL;       // listed by this launch
+	int g_freshCount = 0;
+	int g_freshSize = 0;
+	CRITICAL_SECTION g_lock;
+	LARGE_INTEGER g_frequency;
+}
+
+static unsigned ListingHash(const char* dir, const char* pattern)
+{
+	return dictionary_hash(dir) * 31 + dictionary_hash(pattern);
+}
+
+static int CompareListings(const void* a, const void* b)
+{
+	unsigned ha = ((Listing*) a)->hash, hb = ((Listing*) b)->hash;
+	return ha < hb ? -1 : ha > hb ? 1 : 0;
+}
+
+static Listing* FindListing(const char* dir, const char* pattern)
+{
+	unsigned hash = ListingHash(dir, pattern);
+	int lo = 0, hi = g_cachedCount;
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		if(g_cached[mid].hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for(; lo < g_cachedCount && g_cached[lo].hash == hash; lo++) {
+		if(strcmp(g_cached[lo].dir, dir) == 0 && strcmp(g_cached[lo].pattern, pattern) == 0)
+			return &g_cached[lo];
+	}
+	return NULL;
+}
+
+// Reads the listings back in place from the file buffer
+static bool ParseCache(char* p, char* end, int listings)
+{
+	g_cached = (Listing*) calloc(listings, sizeof(Listing));
+	for(int i = 0; i < listings; i++) {
+		Listing* l = &g_cached[i];
+		DWORD count;
+		if(end - p < sizeof(ULONGLONG) + 2 * sizeof(DWORD))
+			return false;
+		memcpy(&l->stamp, p, sizeof(ULONGLONG));
+		memcpy(&l->scanUs, p + sizeof(ULONGLONG), sizeof(DWORD));
+		memcpy(&count, p + sizeof(ULONGLONG) + sizeof(DWORD), sizeof(DWORD));
+		p += sizeof(ULONGLONG) + 2 * sizeof(DWORD);
+		l->dir = p;
+		p += strlen(p) + 1;
+		if(p >= end)
+			return false;
+		l->pattern = p;
+		p += strlen(p) + 1;
+		if(p > end || count > (DWORD) (end - p))
+			return false;
+		l->count = count;
+		l->entries = (DirEntry*) malloc((l->count ? l->count : 1) * sizeof(DirEntry));
+		g_cachedCount++;
+		for(int j = 0; j < l->count; j++) {
+			if(p >= end)
+				return false;
+			l->entries[j].isDir = (*p & ENTRY_DIR) != 0;
+			l->entries[j].isLink = (*p & ENTRY_LINK) != 0;
+			p++;
+			l->entries[j].name = p;
+			p += strlen(p) + 1;
+			if(p > end)
+				return false;
+		}
+		l->hash = ListingHash(l->dir, l->pattern);
+	}
+	qsort(g_cached, g_cachedCount, sizeof(Listing), CompareListings);
+	return true;
+}
+
+void ClasspathCache::Load(LPCSTR inifile)
+{
+	InitializeCriticalSection(&g_lock);
+	QueryPerformanceFrequency(&g_frequency);
+	g_enabled = inifile != NULL;
+	if(!g_enabled)
+		return;
+
+	_snprintf(g_cacheFile, MAX_PATH, "%s.classpath.cache", inifile);
+	g_cacheFile[MAX_PATH - 1] = 0;
+	HANDLE h = CreateFile(g_cacheFile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if(h == INVALID_HANDLE_VALUE)
+		return;
+
+	CacheHeader hdr;
+	DWORD read = 0;
+	DWORD fileSize = GetFileSize(h, NULL);
+	bool ok = ReadFile(h, &hdr, sizeof(hdr), &read, NULL) && read == sizeof(hdr) &&
+		hdr.magic == CACHE_MAGIC && hdr.version == CACHE_VERSION &&
+		fileSize != INVALID_FILE_SIZE && hdr.size == fileSize - sizeof(hdr);
+	if(ok) {
+		g_buffer = (char*) malloc(hdr.size + 1);
+		ok = ReadFile(h, g_buffer, hdr.size, &read, NULL) && read == hdr.size;
+		g_buffer[hdr.size] = 0;
+	}
+	CloseHandle(h);
+
+	if(ok)
+		ok = ParseCache(g_buffer, g_buffer + hdr.size, hdr.listings);
+	if(!ok) {
+		Log::Info("Ignoring invalid classpath cache: %s", g_cacheFile);
+		for(int i = 0; i < g_cachedCount; i++)
+			free(g_cached[i].entries);
+		free(g_cached);
+		free(g_buffer);
+		g_cached = NULL;
+		g_cachedCount = 0;
+		g_buffer = NULL;
+	}
+}
+
+int ClasspathCache::List(const char* dir, const char* pattern, DirEntry** entries)
+{
+	// Take the time before listing so that a change made while listing is
+	// picked up by the next launch
+	ULONGLONG stamp = 0;
+	if(g_enabled) {
+		stamp = Directory::GetWriteTime(dir);
+		Listing* l = FindListing(dir, pattern);
+		if(l && stamp && l->stamp == stamp) {
+			l->used = true;
+			*entries = l->entries;
+			return l->count;
+		}
+	}
+
+	LARGE_INTEGER start, end;
+	QueryPerformanceCounter(&start);
+	int count = Directory::List(dir, pattern, entries);
+	QueryPerformanceCounter(&end);
+
+	EnterCriticalSection(&g_lock);
+	if(g_freshCount == g_freshSize) {
+		g_freshSize = g_freshSize ? g_freshSize * 2 : 16;
+		g_fresh = (Listing*) realloc(g_fresh, g_freshSize * sizeof(Listing));
+	}
+	Listing* l = &g_fresh[g_freshCount++];
+	l->dir = strdup(dir);
+	l->pattern = strdup(pattern);
+	l->stamp = stamp;
+	l->scanUs = (DWORD) ((end.QuadPart - start.QuadPart) * 1000000 / g_frequency.QuadPart);
+	l->entries = *entries;
+	l->count = count;
+	l->used = true;
+	LeaveCriticalSection(&g_lock);
+
+	return count;
+}
+
+static void SizeListing(Listing* l, CacheHeader& hdr)
+{
+	hdr.listings++;
+	hdr.size += sizeof(ULONGLONG) + 2 * sizeof(DWORD) + strlen(l->dir) + strlen(l->pattern) + 2;
+	for(int i = 0; i < l->count; i++)
+		hdr.size += strlen(l->entries[i].name) + 2;
+}
+
+static char* WriteListing(Listing* l, char* p)
+{
+	memcpy(p, &l->stamp, sizeof(ULONGLONG));
+	memcpy(p + sizeof(ULONGLONG), &l->scanUs, sizeof(DWORD));
+	DWORD count = l->count;
+	memcpy(p + sizeof(ULONGLONG) + sizeof(DWORD), &count, sizeof(DWORD));
+	p += sizeof(ULONGLONG) + 2 * sizeof(DWORD);
+	int len = strlen(l->dir) + 1;
+	memcpy(p, l->dir, len);
+	p += len;
+	len = strlen(l->pattern) + 1;
+	memcpy(p, l->pattern, len);
+	p += len;
+	for(int i = 0; i < l->count; i++) {
+		*p++ = (l->entries[i].isDir ? ENTRY_DIR : 0) | (l->entries[i].isLink ? ENTRY_LINK : 0);
+		len = strlen(l->entries[i].name) + 1;
+		memcpy(p, l->entries[i].name, len);
+		p += len;
+	}
+	return p;
+}
+
+bool ClasspathCache::Save()
+{
+	if(!g_enabled)
+		return false;
+
+	int hits = 0, dropped = 0, scanned = 0;
+	double saved = 0;
+	for(int i = 0; i < g_cachedCount; i++) {
+		if(g_cached[i].used) {
+			hits++;
+			saved += g_cached[i].scanUs / 1000.0;
+		} else {
+			dropped++;
+		}
+	}
+	// Missing directories are not cached
+	for(int i = 0; i < g_freshCount; i++) {
+		if(g_fresh[i].stamp)
+			scanned++;
+	}
+	if(scanned == 0) {
+		Log::Info("Classpath cache hit: %d directories unchanged, saved %.1f ms of listing", hits, saved);
+	} else if(hits > 0) {
+		Log::Info("Classpath cache miss: %d of %d directories rescanned, saved %.1f ms of listing", scanned, hits + scanned, saved);
+	} else {
+		Log::Info("Classpath cache miss: %d directories scanned", scanned);
+	}
+
+	// Nothing to write back when every listing came from the cache
+	if(scanned == 0 && dropped == 0)
+		return true;
+
+	CacheHeader hdr;
+	hdr.magic = CACHE_MAGIC;
+	hdr.version = CACHE_VERSION;
+	hdr.listings = 0;
+	hdr.size = 0;
+	for(int i = 0; i < g_cachedCount; i++) {
+		if(g_cached[i].used)
+			SizeListing(&g_cached[i], hdr);
+	}
+	for(int i = 0; i < g_freshCount; i++) {
+		if(g_fresh[i].stamp)
+			SizeListing(&g_fresh[i], hdr);
+	}
+
+	char* buf = (char*) malloc(sizeof(hdr) + hdr.size);
+	char* p = buf;
+	memcpy(p, &hdr, sizeof(hdr));
+	p += sizeof(hdr);
+	for(int i = 0; i < g_cachedCount; i++) {
+		if(g_cached[i].used)
+			p = WriteListing(&g_cached[i], p);
+	}
+	for(int i = 0; i < g_freshCount; i++) {
+		if(g_fresh[i].stamp)
+			p = WriteListing(&g_fresh[i], p);
+	}
+
+	// Write to a temporary file and swap it in as for the INI cache
+	char tmpfile[MAX_PATH];
+	_snprintf(tmpfile, MAX_PATH, "%s.%d", g_cacheFile, GetCurrentProcessId());
+	tmpfile[MAX_PATH - 1] = 0;
+	bool ok = false;
+	HANDLE h = CreateFile(tmpfile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(h != INVALID_HANDLE_VALUE) {
+		DWORD written = 0;
+		ok = WriteFile(h, buf, sizeof(hdr) + hdr.size, &written, NULL) && written == sizeof(hdr) + hdr.size;
+		CloseHandle(h);
+		if(ok)
+			ok = MoveFileEx(tmpfile, g_cacheFile, MOVEFILE_REPLACE_EXISTING) != 0;
+		if(!ok)
+			DeleteFile(tmpfile);
+	}
+	free(buf);
+
+	if(!ok)
+		Log::Warning("Could not write classpath cache: %s", g_cacheFile);
+	return ok;
+}
+
+void ClasspathCache::Free()
+{
+	for(int i = 0; i < g_freshCount; i++) {
+		free(g_fresh[i].dir);
+		free(g_fresh[i].pattern);
+		Directory::Free(g_fresh[i].entries, g_fresh[i].count);
+	}
+	free(g_fresh);
+	g_fresh = NULL;
+	g_freshCount = g_freshSize = 0;
+
+	// Cached names live in the file buffer
+	for(int i = 0; i < g_cachedCount; i++)
+		free(g_cached[i].entries);
+	free(g_cached);
+	free(g_buffer);
+	g_cached = NULL;
+	g_cachedCount = 0;
+	g_buffer = NULL;
+
+	DeleteCriticalSection(&g_lock);
+	g_enabled = false;
+}
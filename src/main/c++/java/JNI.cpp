@@ -10,6 +10,7 @@
 
 #include "java\JNI.h"
 #include "common/Log.h"
+#include "common/Profile.h"
 
 // Use to store a reference to our embedded classloader (if required)
 static jclass g_classLoaderClass = NULL;
@@ -27,6 +28,7 @@ static jmethodID CLASS_GETCTORS_METHOD;
 void JNI::Init(JNIEnv* env)
 {
 	// Cache handles to class class
+	LONGLONG start = Profile::Start();
 	jclass c = env->FindClass("java/lang/Class");
 	if(!c) {
 		Log::Error("Could not find Class class");
@@ -34,13 +36,16 @@ void JNI::Init(JNIEnv* env)
 	}
 	CLASS_CLASS = (jclass) env->NewGlobalRef(c);
 	CLASS_GETCTORS_METHOD = env->GetMethodID(CLASS_CLASS, "getConstructors", "()[Ljava/lang/reflect/Constructor;");
+	Profile::End(PROFILE_JNI_INIT, start);
 	if(!CLASS_GETCTORS_METHOD) {
 		Log::Error("Could not find Class.getConstructors method");
 		return;
 	}
 
 	// Attempt to load the embedded classloader if required
+	start = Profile::Start();
 	LoadEmbeddedClassloader(env);
+	Profile::End(PROFILE_CLASSLOADER, start);
 }
 
 jclass JNI::FindClass(JNIEnv* env, TCHAR* classStr)
@@ -90,8 +95,12 @@ int JNI::RunMainClass(JNIEnv* env, TCHAR* mainClassStr, int argc, char* argv[])
 		return 1;
 	}
 
-	StrReplace(mainClassStr, '.', '/');
-	jclass mainClass = FindClass(env, mainClassStr);
+	// Convert a copy as the name belongs to the INI
+	LONGLONG start = Profile::Start();
+	TCHAR* mainClassName = _strdup(mainClassStr);
+	StrReplace(mainClassName, '.', '/');
+	jclass mainClass = FindClass(env, mainClassName);
+	free(mainClassName);
 
 	if(mainClass == NULL) {
 		Log::Error("Could not find or initialize main class");
@@ -109,6 +118,11 @@ int JNI::RunMainClass(JNIEnv* env, TCHAR* mainClassStr, int argc, char* argv[])
 		Log::Error("Could not find main method.");
 		return 8;
 	}
+	Profile::End(PROFILE_MAIN_CLASS, start);
+
+	// A profiling launch stops here
+	if(Profile::Report(INI::GetPublished()))
+		return 0;
 
 	env->CallStaticVoidMethod(mainClass, mainMethod, args);
 
@@ -0,0 +1,137 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#include "java/LargePages.h"
+#include "java/VM.h"
+#include "common/Log.h"
+
+#define USE_LARGE_PAGES   "-XX:+UseLargePages"
+#define ALWAYS_PRE_TOUCH  "-XX:+AlwaysPreTouch"
+#define MAX_HEAP_SIZE_ARG "-XX:MaxHeapSize="
+
+// The VM's default heap is a quarter of the memory it may use
+#define DEFAULT_HEAP_DIVISOR 4
+
+// GetLargePageMinimum arrived in Windows Server 2003 so is bound dynamically
+typedef SIZE_T (WINAPI *LPFNGetLargePageMinimum)(void);
+
+static ULONGLONG ParseSize(LPCSTR size)
+{
+	char* end;
+	ULONGLONG value = _strtoui64(size, &end, 10);
+	switch(*end) {
+	case 't': case 'T': value *= 1024;
+		// fall through
+	case 'g': case 'G': value *= 1024;
+		// fall through
+	case 'm': case 'M': value *= 1024;
+		// fall through
+	case 'k': case 'K': value *= 1024;
+	}
+	return value;
+}
+
+// The heap the VM will reserve, from the last -Xmx or -XX:MaxHeapSize
+ULONGLONG LargePages::GetHeapSize(VMResources* budget, TCHAR** args, UINT count)
+{
+	ULONGLONG heap = 0;
+	for(UINT i = 0; i < count; i++) {
+		if(StartsWith(args[i], VM_ARG_HEAPSIZE))
+			heap = ParseSize(args[i] + strlen(VM_ARG_HEAPSIZE));
+		else if(StartsWith(args[i], MAX_HEAP_SIZE_ARG))
+			heap = ParseSize(args[i] + strlen(MAX_HEAP_SIZE_ARG));
+	}
+	if(heap == 0)
+		heap = budget->memory * 1024 * 1024 / DEFAULT_HEAP_DIVISOR;
+	return heap;
+}
+
+// Large pages are locked in memory, which needs "Lock pages in memory". The
+// VM enables the privilege itself, but only if the account holds it.
+bool LargePages::EnableLockMemoryPrivilege()
+{
+	HANDLE token;
+	if(!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+		return false;
+
+	TOKEN_PRIVILEGES tp;
+	tp.PrivilegeCount = 1;
+	tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	bool enabled = LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid) &&
+		AdjustTokenPrivileges(token, FALSE, &tp, 0, NULL, NULL) && GetLastError() == ERROR_SUCCESS;
+	CloseHandle(token);
+	return enabled;
+}
+
+bool LargePages::AddArgs(dictionary* ini, VMResources* budget, TCHAR** args, UINT& count)
+{
+	char* mode = iniparser_getstr(ini, VM_LARGE_PAGES);
+	if(mode == NULL || _stricmp(mode, "off") == 0)
+		return true;
+	bool require = _stricmp(mode, "require") == 0;
+	if(!require && _stricmp(mode, "auto") != 0) {
+		Log::Warning("Unknown vm.large.pages mode: %s", mode);
+		return true;
+	}
+
+	// Leave the VM args alone if they already decide
+	for(UINT i = 0; i < count; i++) {
+		if(StartsWith(args[i], "-XX:+UseLargePages") || StartsWith(args[i], "-XX:-UseLargePages")) {
+			Log::Info("Large pages already chosen by the VM args: %s", args[i]);
+			return true;
+		}
+	}
+
+	char reason[MAX_PATH];
+	reason[0] = 0;
+	LPFNGetLargePageMinimum lpfnGetLargePageMinimum = (LPFNGetLargePageMinimum)
+		GetProcAddress(GetModuleHandle("kernel32"), "GetLargePageMinimum");
+	SIZE_T pageSize = lpfnGetLargePageMinimum ? lpfnGetLargePageMinimum() : 0;
+	ULONGLONG heap = GetHeapSize(budget, args, count);
+	if(pageSize == 0) {
+		strcpy(reason, "the system does not support them");
+	} else if(!EnableLockMemoryPrivilege()) {
+		strcpy(reason, "the account does not hold the \"Lock pages in memory\" privilege");
+	} else {
+		// A heap of large pages cannot be paged out, so it must fit in the
+		// memory that is free now
+		heap = (heap + pageSize - 1) / pageSize * pageSize;
+		MEMORYSTATUSEX ms;
+		ms.dwLength = sizeof(ms);
+		GlobalMemoryStatusEx(&ms);
+		if(heap > ms.ullAvailPhys) {
+			_snprintf(reason, MAX_PATH, "the %I64um heap does not fit in the %I64um of free memory",
+				heap / 1024 / 1024, ms.ullAvailPhys / 1024 / 1024);
+			reason[MAX_PATH - 1] = 0;
+		}
+	}
+
+	if(reason[0]) {
+		if(require) {
+			Log::Error("Large pages are required but %s", reason);
+			return false;
+		}
+		Log::Info("Not using large pages: %s", reason);
+		return true;
+	}
+
+	Log::Info("Using large pages of %dk for a %I64um heap", (int) (pageSize / 1024), heap / 1024 / 1024);
+	args[count++] = _strdup(USE_LARGE_PAGES);
+
+	// Touch the heap as the VM starts rather than on first use
+	bool preTouch = false;
+	for(UINT i = 0; i < count; i++) {
+		if(StartsWith(args[i], "-XX:+AlwaysPreTouch") || StartsWith(args[i], "-XX:-AlwaysPreTouch"))
+			preTouch = true;
+	}
+	if(!preTouch)
+		args[count++] = _strdup(ALWAYS_PRE_TOUCH);
+	return true;
+}
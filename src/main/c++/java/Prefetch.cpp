@@ -0,0 +1,246 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#include "java/Prefetch.h"
+#include "java/Classpath.h"
+#include "common/Profile.h"
+#include "common/Log.h"
+
+#define PREFETCH_DEFAULT_MAX 512
+#define PREFETCH_READ_SIZE   (1024 * 1024)
+
+// PrefetchVirtualMemory arrived in Windows 8 so is bound dynamically
+typedef struct {
+	PVOID VirtualAddress;
+	SIZE_T NumberOfBytes;
+} PrefetchRange;
+
+typedef BOOL (WINAPI *LPFNPrefetchVirtualMemory)(HANDLE hProcess, ULONG_PTR numberOfEntries, PrefetchRange* ranges, ULONG flags);
+
+namespace
+{
+	HANDLE g_thread = 0;
+	CRITICAL_SECTION g_lock;
+	HANDLE g_queued = 0;
+	PrefetchFile* g_files = 0;
+	int g_fileCount = 0;
+	int g_fileSize = 0;
+	int g_queuedCount = 0;   // files the thread may read, guarded by g_lock
+	bool g_last = false;     // no more files will be queued
+	ULONGLONG g_budget = 0;
+	ULONGLONG g_prefetched = 0;
+	volatile LONG g_filesDone = 0;
+	LONGLONG g_started = 0;
+	LONGLONG g_finished = 0;
+}
+
+static int CompareSizes(const void* a, const void* b)
+{
+	ULONGLONG sa = ((const PrefetchFile*) a)->size;
+	ULONGLONG sb = ((const PrefetchFile*) b)->size;
+	return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+void Prefetch::AddFile(LPCSTR path)
+{
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+	if(!GetFileAttributesEx(path, GetFileExInfoStandard, &fad) || (fad.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+		return;
+	ULONGLONG size = ((ULONGLONG) fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+	if(size == 0)
+		return;
+
+	// The thread reads the list while it grows
+	EnterCriticalSection(&g_lock);
+	if(g_fileCount == g_fileSize) {
+		g_fileSize = g_fileSize ? g_fileSize * 2 : 64;
+		g_files = (PrefetchFile*) realloc(g_files, g_fileSize * sizeof(PrefetchFile));
+	}
+	PrefetchFile* file = &g_files[g_fileCount++];
+	strncpy(file->path, path, MAX_PATH);
+	file->path[MAX_PATH - 1] = 0;
+	file->size = size;
+	LeaveCriticalSection(&g_lock);
+}
+
+// Hands the files added since first to the thread, largest first
+void Prefetch::Queue(int first, bool last)
+{
+	EnterCriticalSection(&g_lock);
+	qsort(&g_files[first], g_fileCount - first, sizeof(PrefetchFile), CompareSizes);
+	g_queuedCount = g_fileCount;
+	g_last = last;
+	LeaveCriticalSection(&g_lock);
+	SetEvent(g_queued);
+}
+
+void Prefetch::Start(dictionary* ini, LPSTR vmlibrary)
+{
+	if(g_thread || !iniparser_getboolean(ini, VM_PREFETCH, 0))
+		return;
+	int max = iniparser_getint(ini, VM_PREFETCH_MAX, PREFETCH_DEFAULT_MAX);
+	if(max <= 0)
+		return;
+	g_budget = (ULONGLONG) max * 1024 * 1024;
+
+	InitializeCriticalSection(&g_lock);
+	g_queued = CreateEvent(NULL, FALSE, FALSE, NULL);
+	AddFile(vmlibrary);
+
+	// strip off "bin\server\jvm.dll" to find the runtime's lib directory
+	char path[MAX_PATH];
+	strncpy(path, vmlibrary, MAX_PATH);
+	path[MAX_PATH - 1] = 0;
+	bool home = true;
+	for(int i = 0; i < 3 && home; i++) {
+		char* sep = strrchr(path, '\\');
+		if(sep)
+			*sep = 0;
+		else
+			home = false;
+	}
+	if(home) {
+		int len = strlen(path);
+		strncat(path, "\\lib\\modules", MAX_PATH - len - 1);
+		if(GetFileAttributes(path) == INVALID_FILE_ATTRIBUTES) {
+			path[len] = 0;
+			strncat(path, "\\lib\\rt.jar", MAX_PATH - len - 1);
+		}
+		AddFile(path);
+	}
+	Queue(0, false);
+
+	g_started = Profile::Start();
+	g_thread = CreateThread(0, 0, PrefetchThreadProc, 0, 0, 0);
+}
+
+void Prefetch::AddClasspath(TCHAR** args, UINT count)
+{
+	if(!g_thread)
+		return;
+
+	int first = g_fileCount;
+	for(UINT i = 0; i < count; i++) {
+		if(!StartsWith(args[i], CLASS_PATH_ARG))
+			continue;
+		char* classpath = _strdup(args[i] + strlen(CLASS_PATH_ARG));
+		for(char* entry = strtok(classpath, ";"); entry; entry = strtok(NULL, ";"))
+			AddFile(entry);
+		free(classpath);
+	}
+	Queue(first, true);
+}
+
+// Reads up to size bytes of the file into the file cache, returning how many
+// were asked for
+ULONGLONG Prefetch::ReadAhead(LPCSTR path, ULONGLONG size)
+{
+	static LPFNPrefetchVirtualMemory lpfnPrefetchVirtualMemory = (LPFNPrefetchVirtualMemory)
+		GetProcAddress(GetModuleHandle("kernel32"), "PrefetchVirtualMemory");
+
+	HANDLE h = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if(h == INVALID_HANDLE_VALUE)
+		return 0;
+
+	// Queue the reads of a view of the file. The reads are paging I/O
+	// against the file's section and the pages go to the standby list rather
+	// than the working set, so they belong to the file and not to the view.
+	// Unmapping the view only drops this process's reference, reads in
+	// flight still complete into the file cache, so the view need not be
+	// kept (which would hold the budget's worth of address space).
+	bool queued = false;
+	if(lpfnPrefetchVirtualMemory && size == (SIZE_T) size) {
+		HANDLE map = CreateFileMapping(h, NULL, PAGE_READONLY, 0, 0, NULL);
+		if(map) {
+			void* view = MapViewOfFile(map, FILE_MAP_READ, 0, 0, (SIZE_T) size);
+			if(view) {
+				PrefetchRange range = { view, (SIZE_T) size };
+				queued = lpfnPrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0) != 0;
+				UnmapViewOfFile(view);
+			}
+			CloseHandle(map);
+		}
+	}
+
+	// Otherwise read the file through the cache
+	if(!queued) {
+		char* buffer = (char*) malloc(PREFETCH_READ_SIZE);
+		ULONGLONG remaining = size;
+		DWORD read = 0;
+		while(remaining > 0) {
+			DWORD chunk = remaining < PREFETCH_READ_SIZE ? (DWORD) remaining : PREFETCH_READ_SIZE;
+			if(!ReadFile(h, buffer, chunk, &read, NULL) || read == 0)
+				break;
+			remaining -= read;
+		}
+		size -= remaining;
+		free(buffer);
+	}
+
+	CloseHandle(h);
+	return size;
+}
+
+DWORD WINAPI Prefetch::PrefetchThreadProc(LPVOID param)
+{
+	// Let the threads that need these files now come first
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+
+	// Read each batch as it is queued, until the last one or the budget runs out
+	ULONGLONG remaining = g_budget;
+	PrefetchFile file;
+	for(int i = 0; remaining > 0; i++) {
+		EnterCriticalSection(&g_lock);
+		while(i == g_queuedCount && !g_last) {
+			LeaveCriticalSection(&g_lock);
+			WaitForSingleObject(g_queued, INFINITE);
+			EnterCriticalSection(&g_lock);
+		}
+		bool more = i < g_queuedCount;
+		if(more)
+			file = g_files[i];
+		LeaveCriticalSection(&g_lock);
+		if(!more)
+			break;
+
+		ULONGLONG size = file.size < remaining ? file.size : remaining;
+		size = ReadAhead(file.path, size);
+		remaining -= size;
+		g_prefetched += size;
+		InterlockedIncrement(&g_filesDone);
+	}
+
+	g_finished = Profile::Start();
+	return 0;
+}
+
+void Prefetch::Report()
+{
+	if(!g_thread)
+		return;
+
+	double ms = Profile::ToMillis(Profile::Start() - g_started);
+	if(WaitForSingleObject(g_thread, 0) != WAIT_OBJECT_0) {
+		Log::Info("Prefetch still running after %.1f ms: %d of %d files", ms, g_filesDone, g_queuedCount);
+		return;
+	}
+
+	// Everything the prefetch did overlapped startup, up to this point
+	Log::Info("Prefetched %d files, %I64u bytes in %.1f ms overlapped with startup",
+		g_filesDone, g_prefetched, Profile::ToMillis(g_finished - g_started));
+	CloseHandle(g_thread);
+	g_thread = 0;
+	CloseHandle(g_queued);
+	g_queued = 0;
+	DeleteCriticalSection(&g_lock);
+	free(g_files);
+	g_files = 0;
+	g_fileCount = g_fileSize = g_queuedCount = 0;
+}
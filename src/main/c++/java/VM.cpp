@@ -10,27 +10,29 @@
 
 #include "java\VM.h"
 #include "java\JNI.h"
+#include "java/VMLibrary.h"
+#include "java/VMBudget.h"
+#include "java/LargePages.h"
 #include "common/Log.h"
 #include "common/INI.h"
+#include "common/Profile.h"
 #include "launcher/Service.h"
 
-// VM Registry keys
-#define JRE_REG_PATH             TEXT("Software\\JavaSoft\\Java Runtime Environment")
-#define JRE_REG_PATH_WOW6432     TEXT("Software\\Wow6432Node\\JavaSoft\\Java Runtime Environment")
-#define IBM_JRE_REG_PATH         TEXT("Software\\IBM\\Java2 Runtime Environment")
-#define IBM_JRE_REG_PATH_WOW6432 TEXT("Software\\Wow6432Node\\IBM\\Java2 Runtime Environment")
-#define JRE_VERSION_KEY          TEXT("CurrentVersion")
-#define JRE_LIB_KEY              TEXT("RuntimeLib")
-
 // VM Version keys
 #define MAX_VER
 
 namespace 
 {
 	HINSTANCE g_hInstance = 0;
-	HMODULE g_jniLibrary = 0;
+	void* g_jniLibrary = 0;
 	JavaVM *jvm = 0;
 	JNIEnv *env = 0;
+
+	// The VM library is loaded on a thread of its own while startup goes on
+	HANDLE g_loadThread = 0;
+	TCHAR g_loadPath[MAX_PATH];
+	void* g_createJavaVM = 0;
+	TCHAR g_loadError[MAX_PATH];
 };
 
 typedef jint (JNICALL *JNI_createJavaVM)(JavaVM **pvm, JNIEnv **env, void *args);
@@ -63,16 +65,20 @@ char* VM::FindJavaVMLibrary(dictionary *ini)
 	//	already installed JVM rather than the one specified in "vm.location".
 
 	int findSystemVmFirst = iniparser_getboolean(ini, VM_SYSFIRST, 0);
-	char* vmDefaultLocation = GetJavaVMLibrary(
-		iniparser_getstr(ini, VM_VERSION),
-		iniparser_getstr(ini, VM_VERSION_MIN),
-		iniparser_getstr(ini, VM_VERSION_MAX)
-	);
+	char* vmLocations = iniparser_getstr(ini, VM_LOCATION);
 
-	if (findSystemVmFirst && vmDefaultLocation != NULL)
-		return vmDefaultLocation;
+	// The installed VMs are only looked for when they come first or there is
+	// no vm.location
+	if (findSystemVmFirst || vmLocations == NULL) {
+		char* vmDefaultLocation = GetJavaVMLibrary(ini,
+			iniparser_getstr(ini, VM_VERSION),
+			iniparser_getstr(ini, VM_VERSION_MIN),
+			iniparser_getstr(ini, VM_VERSION_MAX)
+		);
+		if (vmDefaultLocation != NULL || vmLocations == NULL)
+			return vmDefaultLocation;
+	}
 
-	char* vmLocations = iniparser_getstr(ini, VM_LOCATION);
 	//Configuration example: vm.location=..\jre\bin\client\jvm.dll|..\..\jre\bin\client\jvm.dll
 	//Tested: vm.location=|foo|| |..\jre\bin\client\jvm.dll|G:\jdk1.6.0_26_32b\jre\bin\client\jvm.dll
 	Log::Info("Configured vm.location: %s", vmLocations);
@@ -89,8 +95,10 @@ char* VM::FindJavaVMLibrary(dictionary *ini)
 			SetCurrentDirectory(iniparser_getstr(ini, INI_DIR));
 		}
 
+		// Tokenize a copy, the INI value is published as it is
 		char *delimiter = "|";
-	   	char *vmLocation = strtok(vmLocations, delimiter);
+		char *locations = _strdup(vmLocations);
+	   	char *vmLocation = strtok(locations, delimiter);
 	   
 	   	while (vmLocation != NULL)
 	   	{
@@ -107,6 +115,7 @@ char* VM::FindJavaVMLibrary(dictionary *ini)
 					SetCurrentDirectory(defWorkingDir);
 				}
 	
+				free(locations);
 				return strdup(vmFull);
 				
 			}//end of if(fileAttr != INVALID_FILE_ATTRIBUTES)
@@ -115,6 +124,7 @@ char* VM::FindJavaVMLibrary(dictionary *ini)
     		vmLocation = strtok(NULL, delimiter);
 			
 		}//end of while (vmLocation != NULL)
+		free(locations);
 		
 		// Reset working dir if set
 		if(!workingDir) {
@@ -124,71 +134,41 @@ char* VM::FindJavaVMLibrary(dictionary *ini)
 		return NULL;
 	}
 
-	return vmDefaultLocation;
+	return NULL;
 }
 
-// Find an appropriate VM library (this needs improving)
-char* VM::GetJavaVMLibrary(LPSTR version, LPSTR min, LPSTR max)
+// Find an appropriate VM library from those the discovery providers know of
+char* VM::GetJavaVMLibrary(dictionary* ini, LPSTR version, LPSTR min, LPSTR max)
 {
-	TCHAR filename[MAX_PATH];
-	HKEY hKey, hVersionKey;
-
-	// Find the available versions
-	DWORD numVersions = 255;
-	Version versions[255];
-	FindVersions(versions, &numVersions);
-
-	// Now get the appropriate version
-	Version* v = FindVersion(versions, numVersions, version, min, max);
-
-	// If version is null we could not find anything
-	if(!v) return NULL;
-
-	// Now just grab the vm dll from the version
-	if(RegOpenKeyEx(HKEY_LOCAL_MACHINE, v->GetRegPath(), 0, KEY_READ, &hKey) != ERROR_SUCCESS)
-		return NULL;
-
-	if(RegOpenKeyEx(hKey, v->GetVersionStr(), 0, KEY_READ, &hVersionKey) != ERROR_SUCCESS)
-		return NULL;
-
-	DWORD length = MAX_PATH;
-	if(RegQueryValueEx(hVersionKey, JRE_LIB_KEY, NULL, NULL, (LPBYTE)&filename, &length) != ERROR_SUCCESS)
-		return NULL;
-
-// Add check for registry bug with sun amd64 
-#ifdef X64
-	HANDLE hFile = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, 0, 0);
-	if(hFile == INVALID_HANDLE_VALUE) {
-		// In this case we assume the registry says "client" dir but the dll is actually
-		// only available under the "server" dir.
-		int len = strlen(filename);
-		if(len > 14 && strcmp(&filename[len - 14], "client\\jvm.dll") == 0) {
-			char replace[] = "server";
-			for(int i = 0; i < 6; i++) {
-				filename[len - 14 + i] = replace[i];
-			}
-		}
-	} else {
-		CloseHandle(hFile);
+	int count = 0;
+	bool cached = false;
+	VMRuntime* runtimes = VMDiscovery::FindRuntimes(ini, count, cached);
+	VMRuntime* v = FindVersion(runtimes, count, version, min, max);
+
+	// A cached runtime may have been updated or removed since
+	if(v && cached && !VMDiscovery::IsCurrent(v)) {
+		Log::Info("VM cache out of date: %s", v->library);
+		free(runtimes);
+		runtimes = VMDiscovery::FindRuntimes(ini, count, cached, true);
+		v = FindVersion(runtimes, count, version, min, max);
 	}
-#endif
-
-	RegCloseKey(hVersionKey);
-	RegCloseKey(hKey);
 
-	return strdup(filename);
+	char* library = v ? strdup(v->library) : NULL;
+	free(runtimes);
+	return library;
 }
 
-Version* VM::FindVersion(Version* versions, DWORD numVersions, LPSTR version, LPSTR min, LPSTR max)
+VMRuntime* VM::FindVersion(VMRuntime* runtimes, int count, LPSTR version, LPSTR min, LPSTR max)
 {
 	// If an exact version is specified we need to search for it 
 	if(version != NULL)
 	{
-		Version v;
+		Version v, rv;
 		v.Parse(version);
-		for(UINT i = 0; i < numVersions; i++) {
-			if(v.Compare(versions[i]) == 0) {
-				return &versions[i];
+		for(int i = 0; i < count; i++) {
+			rv.Parse(runtimes[i].version);
+			if(v.Compare(rv) == 0) {
+				return &runtimes[i];
 			}
 		}
 
@@ -196,78 +176,24 @@ Version* VM::FindVersion(Version* versions, DWORD numVersions, LPSTR version, LP
 	}
 
 	// Now search for maximum version (that falls between min and max)
-	Version minV, maxV;
+	Version minV, maxV, maxVer, rv;
 	if(min != NULL) minV.Parse(min);
 	if(max != NULL) maxV.Parse(max);
 
-	Version* maxVer = NULL;
-	for(UINT i = 0; i < numVersions; i++) {
-		bool higher = (min == NULL || minV.Compare(versions[i]) <= 0) &&
-			(max == NULL || maxV.Compare(versions[i]) >= 0) &&
-			(maxVer == NULL || maxVer->Compare(versions[i]) < 0);
-
-		if(higher) maxVer = &versions[i];
-	}
+	VMRuntime* maxRuntime = NULL;
+	for(int i = 0; i < count; i++) {
+		rv.Parse(runtimes[i].version);
+		bool higher = (min == NULL || minV.Compare(rv) <= 0) &&
+			(max == NULL || maxV.Compare(rv) >= 0) &&
+			(maxRuntime == NULL || maxVer.Compare(rv) < 0);
 
-	return maxVer;
-}
-
-void VM::FindVersions(Version* versions, DWORD* numVersions)
-{	
-	HKEY hKey;
-	DWORD length;
-	TCHAR version[MAX_PATH];
-	DWORD size = *numVersions;
-	*numVersions = 0;
-
-	if(RegOpenKeyEx(HKEY_LOCAL_MACHINE, JRE_REG_PATH, 0, KEY_READ, &hKey) == ERROR_SUCCESS) {
-		for(; *numVersions < size; (*numVersions)++) {
-			length = MAX_PATH;
-			if(RegEnumKeyEx(hKey, *numVersions, version, &length, NULL, NULL, NULL, NULL) != ERROR_SUCCESS)
-				break;
-			
-			versions[*numVersions].Parse(version);
-			versions[*numVersions].SetRegPath(JRE_REG_PATH);
+		if(higher) {
+			maxRuntime = &runtimes[i];
+			maxVer = rv;
 		}
 	}
 
-	if(RegOpenKeyEx(HKEY_LOCAL_MACHINE, IBM_JRE_REG_PATH, 0, KEY_READ, &hKey) == ERROR_SUCCESS) {
-		DWORD offset = *numVersions;
-		for(; *numVersions < size; (*numVersions)++) {
-			length = MAX_PATH;
-			if(RegEnumKeyEx(hKey, *numVersions - offset, version, &length, NULL, NULL, NULL, NULL) != ERROR_SUCCESS)
-				break;
-			
-			versions[*numVersions].Parse(version);
-			versions[*numVersions].SetRegPath(IBM_JRE_REG_PATH);
-		}
-	}
-
-#ifndef X64
-	// Find the 32 bit installs on a 64 bit machine
-	if(RegOpenKeyEx(HKEY_LOCAL_MACHINE, JRE_REG_PATH_WOW6432, 0, KEY_READ, &hKey) == ERROR_SUCCESS) {
-		for(; *numVersions < size; (*numVersions)++) {
-			length = MAX_PATH;
-			if(RegEnumKeyEx(hKey, *numVersions, version, &length, NULL, NULL, NULL, NULL) != ERROR_SUCCESS)
-				break;
-			
-			versions[*numVersions].Parse(version);
-			versions[*numVersions].SetRegPath(JRE_REG_PATH_WOW6432);
-		}
-	}
-
-	if(RegOpenKeyEx(HKEY_LOCAL_MACHINE, IBM_JRE_REG_PATH_WOW6432, 0, KEY_READ, &hKey) == ERROR_SUCCESS) {
-		DWORD offset = *numVersions;
-		for(; *numVersions < size; (*numVersions)++) {
-			length = MAX_PATH;
-			if(RegEnumKeyEx(hKey, *numVersions - offset, version, &length, NULL, NULL, NULL, NULL) != ERROR_SUCCESS)
-				break;
-			
-			versions[*numVersions].Parse(version);
-			versions[*numVersions].SetRegPath(IBM_JRE_REG_PATH_WOW6432);
-		}
-	}
-#endif
+	return maxRuntime;
 }
 
 int Version::Compare(Version& other) 
@@ -302,17 +228,18 @@ void Version::Parse(LPSTR version)
 	Parsed = true;
 }
 
-void VM::ExtractSpecificVMArgs(dictionary* ini, TCHAR** args, UINT& count)
+bool VM::ExtractSpecificVMArgs(dictionary* ini, TCHAR** args, UINT& count)
 {
-	// Extract memory size
-	MEMORYSTATUS ms;
-	GlobalMemoryStatus(&ms);
+	// Extract memory size from what the VM may use, which in a job object
+	// can be much less than the machine has
+	VMResources budget;
+	VMBudget::Get(ini, &budget);
+	int availMax = budget.memory > 80 ? (int) (budget.memory - 80) : (int) budget.memory;
 #ifdef X64
-	int overallMax = 8000;
+	int overallMax = availMax;
 #else
 	int overallMax = 1530;
 #endif
-	int availMax = (ms.dwTotalPhys/1024/1024) - 80;
 
 	// Look for preferred VM size
 	TCHAR* PreferredHeapSizeStr = iniparser_getstr(ini, HEAP_SIZE_PREFERRED);
@@ -366,92 +293,113 @@ void VM::ExtractSpecificVMArgs(dictionary* ini, TCHAR** args, UINT& count)
 		}
 	}
 
-	// Look for java.library.path.N entries
-	TCHAR *libPaths[MAX_PATH];
-	UINT libPathsCount = 0;
-	INI::GetNumberedKeysFromIni(ini, JAVA_LIBRARY_PATH, libPaths, libPathsCount);
-	if(libPathsCount > 0) {
-		TCHAR libPathArg[4096];
-		libPathArg[0] = 0;
-		TCHAR pathArg[4096];
+	// Tell the VM about limits it cannot see for itself
+	VMBudget::AddArgs(&budget, args, count);
+
+	// Check the host can back the heap with large pages now that its size is known
+	return LargePages::AddArgs(ini, &budget, args, count);
+}
+
+// The directories are also put on the PATH, which has to happen before the
+// VM library is loaded so that its dependencies are found there
+void VM::SetLibraryPath(dictionary* ini, TCHAR** args, UINT& count)
+{
+	dictionary_list* libPaths = dictionary_getlist(ini, JAVA_LIBRARY_PATH);
+	if(libPaths != NULL) {
+		char* path = getenv("PATH");
+		int len = 0;
+		for(int i = 0; i < libPaths->n; i++) {
+			char* libPath = dictionary_getval(ini, libPaths->slot[i]);
+			if(libPath) len += strlen(libPath) + 1;
+		}
+		TCHAR* libPathArg = (TCHAR*) malloc(len + strlen("-Djava.library.path=") + 1);
+		TCHAR* pathArg = (TCHAR*) malloc(len + (path ? strlen(path) : 0) + 1);
+		strcpy(libPathArg, "-Djava.library.path=");
 		pathArg[0] = 0;
-		strcat(libPathArg, "-Djava.library.path=");
-		for(int i =0 ; i < libPathsCount; i++) {
-			strcat(libPathArg, libPaths[i]);
+		for(int i = 0; i < libPaths->n; i++) {
+			char* libPath = dictionary_getval(ini, libPaths->slot[i]);
+			if(!libPath) continue;
+			strcat(libPathArg, libPath);
 			strcat(libPathArg, ";");
-			strcat(pathArg, libPaths[i]);
+			strcat(pathArg, libPath);
 			strcat(pathArg, ";");
 		}
-		strcat(pathArg, getenv("PATH"));
-		SetEnvironmentVariable("PATH", strdup(pathArg));
-		args[count++] = strdup(libPathArg);
+		if(path) strcat(pathArg, path);
+		INI::SetEnvironment(ini, "PATH", pathArg);
+		free(pathArg);
+		args[count++] = libPathArg;
 	}
 }
 
-void VM::LoadRuntimeLibrary(TCHAR* libPath)
+// Loads the VM library and finds JNI_CreateJavaVM. This runs on the load
+// thread, so failures are kept for StartJavaVM to log.
+static DWORD WINAPI LoadJavaVMThreadProc(LPVOID param)
 {
-	int len = strlen(libPath);
-	TCHAR binPath[MAX_PATH];
-	strcpy(binPath, libPath);
-
-	// strip off "client\jvm.dll" or "server\jvm.dll"
-	int i, sc=0;
-	for(i = len - 1; i >=0; i--) {
-		if(binPath[i] == '\\') {
-			binPath[i] = 0;
-			sc++;
-			if(sc>1)
-				break;
-		}
+	// Load anything the VM library depends on and then the library itself
+	LONGLONG start = Profile::Start();
+	VMLibrary::Prepare(g_loadPath);
+	Profile::End(PROFILE_VM_RUNTIME, start);
+
+	start = Profile::Start();
+	g_jniLibrary = VMLibrary::Load(g_loadPath);
+	Profile::End(PROFILE_VM_LOAD, start);
+	char error[MAX_PATH];
+	if(g_jniLibrary == NULL) {
+		VMLibrary::GetError(error, MAX_PATH);
+		_snprintf(g_loadError, MAX_PATH, "Could not load library: %s (%s)", g_loadPath, error);
+		g_loadError[MAX_PATH - 1] = 0;
+		return 1;
 	}
 
-	// Append library path and load - we have a couple of choices here depending on 
-	// VM version - we don't treat failure here as an error as some VM versions
-	// don't have this runtime installed
-	strcat(binPath, "\\msvcr71.dll");
-	if(!LoadLibrary(binPath)) {
-		binPath[i] = 0;
-		strcat(binPath, "\\msvcrt.dll");
-		if(!LoadLibrary(binPath)) {
-			binPath[i] = 0;
-			strcat(binPath, "\\msvcr100.dll");
-			if(!LoadLibrary(binPath)) {
-				// Now resort to using SetDllDirectory - must use dynamic binding as 
-				// this function is not available on all versions of windows
-				typedef BOOL (WINAPI *LPFNSetDllDirectory)(LPCTSTR lpPathname);
-				HINSTANCE hKernel32 = GetModuleHandle("kernel32");
-				LPFNSetDllDirectory lpfnSetDllDirectory = (LPFNSetDllDirectory)GetProcAddress(hKernel32, "SetDllDirectoryA");
-				if (lpfnSetDllDirectory != NULL) {
-					binPath[i] = 0;
-					lpfnSetDllDirectory(binPath);
-				}
-			}
-		}
+	// Grab the create VM function address
+	g_createJavaVM = VMLibrary::GetSymbol(g_jniLibrary, "JNI_CreateJavaVM");
+	if(g_createJavaVM == NULL) {
+		VMLibrary::GetError(error, MAX_PATH);
+		_snprintf(g_loadError, MAX_PATH, "Could not find JNI_CreateJavaVM function (%s)", error);
+		g_loadError[MAX_PATH - 1] = 0;
+		return 1;
 	}
+
+	return 0;
 }
 
-int VM::StartJavaVM(TCHAR* libPath, TCHAR* vmArgs[], HINSTANCE hInstance)
+void VM::PreloadJavaVM(dictionary* ini, TCHAR* libPath)
 {
-	g_hInstance = hInstance;
+	if(g_loadThread || !iniparser_getboolean(ini, VM_PRELOAD, 1))
+		return;
 
-	// We need to load an MS runtime library before the VM otherwise 
-	// bad things happen so we assume the VM is located under a bin path and 
-	// inside this bin dir there is the dll
-	LoadRuntimeLibrary(libPath);
+	strncpy(g_loadPath, libPath, MAX_PATH);
+	g_loadPath[MAX_PATH - 1] = 0;
+	g_loadThread = CreateThread(0, 0, LoadJavaVMThreadProc, 0, 0, 0);
+}
 
-	// Load the JVM library 
-	g_jniLibrary = LoadLibrary(libPath);
-	if(g_jniLibrary == NULL) {
-		Log::Error("ERROR: Could not load library: %s", libPath);
-		return -1;
+void VM::WaitForPreload()
+{
+	if(g_loadThread) {
+		LONGLONG start = Profile::Start();
+		WaitForSingleObject(g_loadThread, INFINITE);
+		CloseHandle(g_loadThread);
+		g_loadThread = 0;
+		Profile::End(PROFILE_VM_WAIT, start);
 	}
+}
 
-	// Grab the create VM function address
-	JNI_createJavaVM createJavaVM = (JNI_createJavaVM)GetProcAddress(g_jniLibrary, "JNI_CreateJavaVM");
-	if(createJavaVM == NULL) {
-		Log::Error("ERROR: Could not find JNI_CreateJavaVM function");
-		return -1; 
+int VM::StartJavaVM(TCHAR* libPath, TCHAR* vmArgs[], HINSTANCE hInstance)
+{
+	g_hInstance = hInstance;
+
+	// Use the library loaded by PreloadJavaVM, or load it now if it was not
+	WaitForPreload();
+	if(g_jniLibrary == NULL && g_loadError[0] == 0) {
+		strncpy(g_loadPath, libPath, MAX_PATH);
+		g_loadPath[MAX_PATH - 1] = 0;
+		LoadJavaVMThreadProc(0);
+	}
+	if(g_createJavaVM == NULL) {
+		Log::Error("ERROR: %s", g_loadError);
+		return -1;
 	}
+	JNI_createJavaVM createJavaVM = (JNI_createJavaVM) g_createJavaVM;
 
 	// Count the vm args
 	int numVMArgs = -1;
@@ -478,7 +426,9 @@ int VM::StartJavaVM(TCHAR* libPath, TCHAR* vmArgs[], HINSTANCE hInstance)
 	init_args.nOptions = numVMArgs + numHooks;
 	init_args.ignoreUnrecognized = JNI_TRUE;
 	
+	LONGLONG start = Profile::Start();
 	int result = createJavaVM(&jvm, &env, &init_args);
+	Profile::End(PROFILE_VM_CREATE, start);
 
 	for(int i = 0; i < numVMArgs; i++){
 		free( options[i].optionString );
@@ -490,8 +440,10 @@ int VM::StartJavaVM(TCHAR* libPath, TCHAR* vmArgs[], HINSTANCE hInstance)
 
 int VM::CleanupVM() 
 {
+	WaitForPreload();
 	if (jvm == 0 || env == 0) {
-		FreeLibrary(g_jniLibrary);
+		VMLibrary::Free(g_jniLibrary);
+		g_jniLibrary = 0;
 		return 1;
 	}
 
@@ -499,10 +451,8 @@ int VM::CleanupVM()
 	JNI::PrintStackTrace(env);
 
 	int result = jvm->DestroyJavaVM();
-	if(g_jniLibrary) {
-		FreeLibrary(g_jniLibrary);
-		g_jniLibrary = 0;
-	}
+	VMLibrary::Free(g_jniLibrary);
+	g_jniLibrary = 0;
 
 	env = 0;
 	jvm = 0;
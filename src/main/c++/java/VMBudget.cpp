@@ -0,0 +1,155 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#include "java/VMBudget.h"
+#include "common/Log.h"
+
+// The VM picks the serial collector itself below this on a machine of its
+// own, but cannot see the limits of a job
+#define SERVER_CLASS_CPUS   2
+#define SERVER_CLASS_MEMORY 1792
+
+// JobObjectCpuRateControlInformation arrived in Windows 8 so is declared here
+#define JOB_CPU_RATE_INFORMATION  15
+#define JOB_CPU_RATE_ENABLE       0x1
+#define JOB_CPU_RATE_HARD_CAP     0x4
+#define JOB_CPU_RATE_MIN_MAX_RATE 0x10
+
+typedef struct {
+	DWORD ControlFlags;
+	DWORD CpuRate;          // 1/100 of a percent of all processors, or
+	                        // MinRate and MaxRate in the low and high words
+} JobCpuRateInformation;
+
+static bool HasArg(TCHAR** args, UINT count, LPSTR prefix)
+{
+	for(UINT i = 0; i < count; i++) {
+		if(StartsWith(args[i], prefix))
+			return true;
+	}
+	return false;
+}
+
+static bool HasCollectorArg(TCHAR** args, UINT count)
+{
+	for(UINT i = 0; i < count; i++) {
+		int len = strlen(args[i]);
+		if(StartsWith(args[i], "-XX:+Use") && len > 2 && strcmp(&args[i][len - 2], "GC") == 0)
+			return true;
+	}
+	return false;
+}
+
+void VMBudget::GetJobLimits(VMResources* budget)
+{
+	JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits;
+	if(QueryInformationJobObject(NULL, JobObjectExtendedLimitInformation, &limits, sizeof(limits), NULL)) {
+		DWORD flags = limits.BasicLimitInformation.LimitFlags;
+		ULONGLONG memory = 0;
+		if(flags & JOB_OBJECT_LIMIT_JOB_MEMORY)
+			memory = limits.JobMemoryLimit;
+		if((flags & JOB_OBJECT_LIMIT_PROCESS_MEMORY) && (memory == 0 || limits.ProcessMemoryLimit < memory))
+			memory = limits.ProcessMemoryLimit;
+		memory /= 1024 * 1024;
+		if(memory > 0 && memory < budget->memory) {
+			budget->memory = memory;
+			budget->memoryLimited = true;
+			budget->memorySource = "job object";
+		}
+	}
+
+	JobCpuRateInformation rate;
+	if(QueryInformationJobObject(NULL, (JOBOBJECTINFOCLASS) JOB_CPU_RATE_INFORMATION, &rate, sizeof(rate), NULL) &&
+		(rate.ControlFlags & JOB_CPU_RATE_ENABLE)) {
+		DWORD cpuRate = 0;
+		if(rate.ControlFlags & JOB_CPU_RATE_HARD_CAP)
+			cpuRate = rate.CpuRate;
+		else if(rate.ControlFlags & JOB_CPU_RATE_MIN_MAX_RATE)
+			cpuRate = HIWORD(rate.CpuRate);
+		if(cpuRate > 0) {
+			SYSTEM_INFO si;
+			GetSystemInfo(&si);
+			int cpus = (int) ((cpuRate * si.dwNumberOfProcessors + 9999) / 10000);
+			if(cpus < budget->cpus) {
+				budget->cpus = cpus;
+				budget->cpusLimited = true;
+				budget->cpuSource = "job object";
+			}
+		}
+	}
+}
+
+void VMBudget::Get(dictionary* ini, VMResources* budget)
+{
+	MEMORYSTATUSEX ms;
+	ms.dwLength = sizeof(ms);
+	GlobalMemoryStatusEx(&ms);
+	budget->memory = ms.ullTotalPhys / 1024 / 1024;
+	budget->memoryLimited = false;
+	budget->memorySource = "physical memory";
+
+	// The affinity mask already takes in the job's affinity
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	budget->cpus = si.dwNumberOfProcessors;
+	budget->cpusLimited = false;
+	budget->cpuSource = "processors";
+	DWORD_PTR processMask, systemMask;
+	if(GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask)) {
+		int cpus = 0;
+		for(; processMask; processMask &= processMask - 1)
+			cpus++;
+		if(cpus > 0 && cpus < budget->cpus) {
+			budget->cpus = cpus;
+			budget->cpusLimited = true;
+			budget->cpuSource = "affinity";
+		}
+	}
+
+	GetJobLimits(budget);
+
+	int memory = iniparser_getint(ini, VM_BUDGET_MEMORY, 0);
+	if(memory > 0) {
+		budget->memory = memory;
+		budget->memoryLimited = true;
+		budget->memorySource = "vm.budget.memory";
+	}
+	int cpus = iniparser_getint(ini, VM_BUDGET_CPUS, 0);
+	if(cpus > 0) {
+		budget->cpus = cpus;
+		budget->cpusLimited = true;
+		budget->cpuSource = "vm.budget.cpus";
+	}
+
+	Log::Info("VM budget: %I64um (%s), %d processors (%s)", budget->memory, budget->memorySource,
+		budget->cpus, budget->cpuSource);
+}
+
+void VMBudget::AddArgs(VMResources* budget, TCHAR** args, UINT& count)
+{
+	TCHAR arg[MAX_PATH];
+
+	// Lets the VM size its heap and other memory from the budget when no
+	// heap size is given
+	if(budget->memoryLimited && !HasArg(args, count, "-XX:MaxRAM=")) {
+		sprintf(arg, "-XX:MaxRAM=%I64um", budget->memory);
+		args[count++] = _strdup(arg);
+	}
+
+	if(budget->cpusLimited && !HasArg(args, count, "-XX:ActiveProcessorCount=")) {
+		sprintf(arg, "-XX:ActiveProcessorCount=%d", budget->cpus);
+		args[count++] = _strdup(arg);
+	}
+
+	if((budget->memoryLimited || budget->cpusLimited) && !HasCollectorArg(args, count) &&
+		(budget->cpus < SERVER_CLASS_CPUS || budget->memory < SERVER_CLASS_MEMORY)) {
+		args[count++] = _strdup("-XX:+UseSerialGC");
+	}
+}
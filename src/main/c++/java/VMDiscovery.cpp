@@ -0,0 +1,484 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#include "java/VMDiscovery.h"
+#include "common/Directory.h"
+#include "common/Log.h"
+
+// VM Registry keys
+#define JRE_REG_PATH             TEXT("Software\\JavaSoft\\Java Runtime Environment")
+#define JRE_REG_PATH_WOW6432     TEXT("Software\\Wow6432Node\\JavaSoft\\Java Runtime Environment")
+#define IBM_JRE_REG_PATH         TEXT("Software\\IBM\\Java2 Runtime Environment")
+#define IBM_JRE_REG_PATH_WOW6432 TEXT("Software\\Wow6432Node\\IBM\\Java2 Runtime Environment")
+#define JRE_LIB_KEY              TEXT("RuntimeLib")
+
+#define CACHE_MAGIC   MAKEFOURCC('V','M','R','C')
+#define CACHE_VERSION 1
+
+#ifdef X64
+#define VM_ARCH IMAGE_FILE_MACHINE_AMD64
+#else
+#define VM_ARCH IMAGE_FILE_MACHINE_I386
+#endif
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME  1099511628211ULL
+
+typedef struct {
+	DWORD magic;
+	DWORD version;
+	DWORD count;
+	DWORD reserved;
+	ULONGLONG stamp;
+} CacheHeader;
+
+static ULONGLONG HashBytes(ULONGLONG hash, const void* data, int len)
+{
+	const BYTE* p = (const BYTE*) data;
+	for(int i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+static ULONGLONG HashString(ULONGLONG hash, LPCSTR s)
+{
+	return s ? HashBytes(hash, s, strlen(s) + 1) : HashBytes(hash, "", 1);
+}
+
+// Registry provider: the runtimes installers record under HKLM
+
+typedef struct {
+	LPCSTR path;
+	LPCSTR vendor;
+} RegistryTree;
+
+static const RegistryTree g_registryTrees[] = {
+	{ JRE_REG_PATH, "Oracle" },
+	{ IBM_JRE_REG_PATH, "IBM" },
+#ifndef X64
+	// The 32 bit installs on a 64 bit machine
+	{ JRE_REG_PATH_WOW6432, "Oracle" },
+	{ IBM_JRE_REG_PATH_WOW6432, "IBM" },
+#endif
+};
+
+#define REGISTRY_TREES (sizeof(g_registryTrees) / sizeof(g_registryTrees[0]))
+
+static ULONGLONG StampRegistry(dictionary* ini, ULONGLONG hash)
+{
+	// Adding or removing a version key changes the time of its parent
+	for(int i = 0; i < REGISTRY_TREES; i++) {
+		HKEY hKey;
+		FILETIME ft = { 0, 0 };
+		if(RegOpenKeyEx(HKEY_LOCAL_MACHINE, g_registryTrees[i].path, 0, KEY_READ, &hKey) == ERROR_SUCCESS) {
+			RegQueryInfoKey(hKey, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &ft);
+			RegCloseKey(hKey);
+		}
+		hash = HashBytes(hash, &ft, sizeof(ft));
+	}
+	return hash;
+}
+
+static bool GetRuntimeLib(HKEY hKey, LPCSTR version, LPSTR filename)
+{
+	HKEY hVersionKey;
+	if(RegOpenKeyEx(hKey, version, 0, KEY_READ, &hVersionKey) != ERROR_SUCCESS)
+		return false;
+	DWORD length = MAX_PATH;
+	bool found = RegQueryValueEx(hVersionKey, JRE_LIB_KEY, NULL, NULL, (LPBYTE) filename, &length) == ERROR_SUCCESS;
+	RegCloseKey(hVersionKey);
+	if(!found)
+		return false;
+	filename[MAX_PATH - 1] = 0;
+
+// Add check for registry bug with sun amd64
+#ifdef X64
+	if(GetFileAttributes(filename) == INVALID_FILE_ATTRIBUTES) {
+		// In this case we assume the registry says "client" dir but the dll is actually
+		// only available under the "server" dir.
+		int len = strlen(filename);
+		if(len > 14 && strcmp(&filename[len - 14], "client\\jvm.dll") == 0) {
+			char replace[] = "server";
+			for(int i = 0; i < 6; i++) {
+				filename[len - 14 + i] = replace[i];
+			}
+		}
+	}
+#endif
+
+	return true;
+}
+
+static void DiscoverRegistry(dictionary* ini, VMRuntimeList* list)
+{
+	TCHAR version[MAX_PATH];
+	TCHAR library[MAX_PATH];
+	for(int i = 0; i < REGISTRY_TREES; i++) {
+		HKEY hKey;
+		if(RegOpenKeyEx(HKEY_LOCAL_MACHINE, g_registryTrees[i].path, 0, KEY_READ, &hKey) != ERROR_SUCCESS)
+			continue;
+		for(DWORD index = 0; ; index++) {
+			DWORD length = MAX_PATH;
+			if(RegEnumKeyEx(hKey, index, version, &length, NULL, NULL, NULL, NULL) != ERROR_SUCCESS)
+				break;
+			if(GetRuntimeLib(hKey, version, library))
+				VMDiscovery::AddRuntime(list, library, version, g_registryTrees[i].vendor);
+		}
+		RegCloseKey(hKey);
+	}
+}
+
+// Scan provider: runtimes unpacked into JAVA_HOME or the vm.scan.N
+// directories, which may be a runtime or hold one in each subdirectory
+
+static const char* g_libraryPaths[] = {
+	"bin\\server\\jvm.dll",
+	"bin\\client\\jvm.dll",
+	"jre\\bin\\server\\jvm.dll",
+	"jre\\bin\\client\\jvm.dll",
+};
+
+#define LIBRARY_PATHS (sizeof(g_libraryPaths) / sizeof(g_libraryPaths[0]))
+
+// The configured directories, relative ones are taken from the INI directory.
+// Without any the default install location is scanned.
+static TCHAR** GetScanRoots(dictionary* ini, UINT& count)
+{
+	TCHAR** roots = INI::GetNumberedKeysFromIni(ini, VM_SCAN, count, 1);
+	for(UINT i = 0; i < count; i++) {
+		if(roots[i][0] == '\\' || (roots[i][0] && roots[i][1] == ':'))
+			continue;
+		char root[MAX_PATH];
+		_snprintf(root, MAX_PATH, "%s\\%s", iniparser_getstr(ini, INI_DIR), roots[i]);
+		root[MAX_PATH - 1] = 0;
+		free(roots[i]);
+		roots[i] = strdup(root);
+	}
+	if(count == 0) {
+		char root[MAX_PATH];
+		DWORD len = GetEnvironmentVariable("ProgramFiles", root, MAX_PATH);
+		if(len > 0 && len < MAX_PATH - 5) {
+			strcat(root, "\\Java");
+			roots[count++] = strdup(root);
+		}
+	}
+	return roots;
+}
+
+static void FreeScanRoots(TCHAR** roots, UINT count)
+{
+	for(UINT i = 0; i < count; i++)
+		free(roots[i]);
+	free(roots);
+}
+
+static ULONGLONG StampScan(dictionary* ini, ULONGLONG hash)
+{
+	// Unpacking or removing a runtime changes the time of the directory
+	char home[MAX_PATH];
+	DWORD len = GetEnvironmentVariable("JAVA_HOME", home, MAX_PATH);
+	hash = HashString(hash, len > 0 && len < MAX_PATH ? home : NULL);
+	UINT count = 0;
+	TCHAR** roots = GetScanRoots(ini, count);
+	for(UINT i = 0; i < count; i++) {
+		ULONGLONG time = Directory::GetWriteTime(roots[i]);
+		hash = HashString(hash, roots[i]);
+		hash = HashBytes(hash, &time, sizeof(time));
+	}
+	FreeScanRoots(roots, count);
+	return hash;
+}
+
+static bool ScanHome(VMRuntimeList* list, LPCSTR home)
+{
+	char library[MAX_PATH];
+	for(int i = 0; i < LIBRARY_PATHS; i++) {
+		_snprintf(library, MAX_PATH, "%s\\%s", home, g_libraryPaths[i]);
+		library[MAX_PATH - 1] = 0;
+		if(GetFileAttributes(library) == INVALID_FILE_ATTRIBUTES)
+			continue;
+		char version[64];
+		if(VMDiscovery::GetReleaseValue(library, "JAVA_VERSION", version, sizeof(version)))
+			VMDiscovery::AddRuntime(list, library, version, NULL);
+		else
+			Log::Info("Ignoring VM without a version: %s", library);
+		return true;
+	}
+	return false;
+}
+
+static void DiscoverScan(dictionary* ini, VMRuntimeList* list)
+{
+	char home[MAX_PATH];
+	DWORD len = GetEnvironmentVariable("JAVA_HOME", home, MAX_PATH);
+	if(len > 0 && len < MAX_PATH)
+		ScanHome(list, home);
+
+	UINT count = 0;
+	TCHAR** roots = GetScanRoots(ini, count);
+	for(UINT i = 0; i < count; i++) {
+		if(ScanHome(list, roots[i]))
+			continue;
+		DirEntry* entries;
+		int entryCount = Directory::List(roots[i], "*", &entries);
+		for(int j = 0; j < entryCount; j++) {
+			if(!entries[j].isDir)
+				continue;
+			_snprintf(home, MAX_PATH, "%s\\%s", roots[i], entries[j].name);
+			home[MAX_PATH - 1] = 0;
+			ScanHome(list, home);
+		}
+		Directory::Free(entries, entryCount);
+	}
+	FreeScanRoots(roots, count);
+}
+
+static VMProvider g_providers[] = {
+	{ "registry", StampRegistry, DiscoverRegistry },
+	{ "scan", StampScan, DiscoverScan },
+};
+
+#define PROVIDERS (sizeof(g_providers) / sizeof(g_providers[0]))
+
+VMProvider* VMDiscovery::GetProvider(const char* name, int len)
+{
+	for(int i = 0; i < PROVIDERS; i++) {
+		if(strlen(g_providers[i].name) == len && _strnicmp(g_providers[i].name, name, len) == 0)
+			return &g_providers[i];
+	}
+	return NULL;
+}
+
+bool VMDiscovery::GetReleaseValue(LPCSTR library, LPCSTR key, LPSTR value, int size)
+{
+	// strip off "bin\server\jvm.dll", a JDK 8 library is in its "jre" directory
+	char path[MAX_PATH];
+	strncpy(path, library, MAX_PATH);
+	path[MAX_PATH - 1] = 0;
+	for(int i = 0; i < 3; i++) {
+		char* sep = strrchr(path, '\\');
+		if(!sep)
+			return false;
+		*sep = 0;
+	}
+	int homeLen = strlen(path);
+	strncat(path, "\\release", MAX_PATH - homeLen - 1);
+	HANDLE h = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if(h == INVALID_HANDLE_VALUE && homeLen > 4 && _strnicmp(&path[homeLen - 4], "\\jre", 4) == 0) {
+		strcpy(&path[homeLen - 4], "\\release");
+		h = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	}
+	if(h == INVALID_HANDLE_VALUE)
+		return false;
+	char buf[8192];
+	DWORD read = 0;
+	ReadFile(h, buf, sizeof(buf) - 1, &read, NULL);
+	CloseHandle(h);
+	buf[read] = 0;
+
+	// Lines are KEY="value"
+	int keyLen = strlen(key);
+	for(char* line = buf; line && *line; line = strchr(line, '\n')) {
+		while(*line == '\n' || *line == '\r')
+			line++;
+		if(strncmp(line, key, keyLen) != 0 || line[keyLen] != '=' || line[keyLen + 1] != '"')
+			continue;
+		char* v = &line[keyLen + 2];
+		int len = strcspn(v, "\"\r\n");
+		if(len >= size)
+			len = size - 1;
+		memcpy(value, v, len);
+		value[len] = 0;
+		return true;
+	}
+	return false;
+}
+
+WORD VMDiscovery::GetLibraryArch(LPCSTR library)
+{
+	HANDLE h = CreateFile(library, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if(h == INVALID_HANDLE_VALUE)
+		return 0;
+	BYTE buf[4096];
+	DWORD read = 0;
+	ReadFile(h, buf, sizeof(buf), &read, NULL);
+	CloseHandle(h);
+	if(read < sizeof(IMAGE_DOS_HEADER))
+		return 0;
+	IMAGE_DOS_HEADER* dos = (IMAGE_DOS_HEADER*) buf;
+	if(dos->e_magic != IMAGE_DOS_SIGNATURE || dos->e_lfanew < 0 || dos->e_lfanew + sizeof(DWORD) + sizeof(IMAGE_FILE_HEADER) > read)
+		return 0;
+	if(*(DWORD*) &buf[dos->e_lfanew] != IMAGE_NT_SIGNATURE)
+		return 0;
+	return ((IMAGE_FILE_HEADER*) &buf[dos->e_lfanew + sizeof(DWORD)])->Machine;
+}
+
+void VMDiscovery::AddRuntime(VMRuntimeList* list, LPCSTR library, LPCSTR version, LPCSTR vendor)
+{
+	// The registry has a key for the family as well as the update ("1.8" and
+	// "1.8.0_201") which both name the same library
+	for(int i = 0; i < list->count; i++) {
+		if(_stricmp(list->runtimes[i].library, library) == 0 && strcmp(list->runtimes[i].version, version) == 0)
+			return;
+	}
+	ULONGLONG stamp = Directory::GetWriteTime(library);
+	if(stamp == 0) {
+		Log::Info("VM library not found: %s", library);
+		return;
+	}
+	WORD arch = GetLibraryArch(library);
+	if(arch && arch != VM_ARCH) {
+		Log::Info("Ignoring VM for another architecture: %s", library);
+		return;
+	}
+	if(list->count == list->size) {
+		list->size = list->size ? list->size * 2 : 16;
+		list->runtimes = (VMRuntime*) realloc(list->runtimes, list->size * sizeof(VMRuntime));
+	}
+	VMRuntime* r = &list->runtimes[list->count++];
+	memset(r, 0, sizeof(VMRuntime));
+	strncpy(r->library, library, sizeof(r->library) - 1);
+	strncpy(r->version, version, sizeof(r->version) - 1);
+	if(!GetReleaseValue(library, "IMPLEMENTOR", r->vendor, sizeof(r->vendor)) && vendor)
+		strncpy(r->vendor, vendor, sizeof(r->vendor) - 1);
+	r->arch = arch;
+	r->stamp = stamp;
+}
+
+bool VMDiscovery::IsCurrent(VMRuntime* runtime)
+{
+	ULONGLONG stamp = Directory::GetWriteTime(runtime->library);
+	return stamp != 0 && stamp == runtime->stamp;
+}
+
+// Everything the list of runtimes depends on, which is far cheaper to check
+// than finding them again
+ULONGLONG VMDiscovery::GetStamp(dictionary* ini)
+{
+	ULONGLONG hash = FNV_OFFSET;
+	DWORD arch = VM_ARCH;
+	hash = HashBytes(hash, &arch, sizeof(arch));
+	const char* providers = iniparser_getstring(ini, VM_DISCOVERY, "registry");
+	hash = HashString(hash, providers);
+	for(const char* p = providers; *p; ) {
+		int len = strcspn(p, ", ");
+		VMProvider* provider = GetProvider(p, len);
+		if(provider)
+			hash = provider->Stamp(ini, hash);
+		p += len;
+		p += strspn(p, ", ");
+	}
+	return hash;
+}
+
+void VMDiscovery::GetCacheFile(dictionary* ini, LPSTR cachefile)
+{
+	_snprintf(cachefile, MAX_PATH, "%s.vm.cache", iniparser_getstr(ini, MODULE_INI));
+	cachefile[MAX_PATH - 1] = 0;
+}
+
+VMRuntime* VMDiscovery::LoadCache(dictionary* ini, ULONGLONG stamp, int& count)
+{
+	char cachefile[MAX_PATH];
+	GetCacheFile(ini, cachefile);
+	HANDLE h = CreateFile(cachefile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+	if(h == INVALID_HANDLE_VALUE)
+		return NULL;
+
+	CacheHeader hdr;
+	DWORD read = 0;
+	DWORD fileSize = GetFileSize(h, NULL);
+	if(!ReadFile(h, &hdr, sizeof(hdr), &read, NULL) || read != sizeof(hdr) ||
+		hdr.magic != CACHE_MAGIC || hdr.version != CACHE_VERSION ||
+		fileSize != sizeof(hdr) + hdr.count * sizeof(VMRuntime) || hdr.stamp != stamp) {
+		CloseHandle(h);
+		Log::Info("VM cache out of date: %s", cachefile);
+		return NULL;
+	}
+
+	DWORD size = hdr.count * sizeof(VMRuntime);
+	VMRuntime* runtimes = (VMRuntime*) malloc(size ? size : 1);
+	BOOL ok = ReadFile(h, runtimes, size, &read, NULL) && read == size;
+	CloseHandle(h);
+	if(!ok) {
+		free(runtimes);
+		return NULL;
+	}
+	count = hdr.count;
+	return runtimes;
+}
+
+void VMDiscovery::SaveCache(dictionary* ini, ULONGLONG stamp, VMRuntime* runtimes, int count)
+{
+	CacheHeader hdr;
+	hdr.magic = CACHE_MAGIC;
+	hdr.version = CACHE_VERSION;
+	hdr.count = count;
+	hdr.reserved = 0;
+	hdr.stamp = stamp;
+
+	// Write to a temporary file and swap it in so concurrent launches never
+	// see a partial list
+	char cachefile[MAX_PATH], tmpfile[MAX_PATH];
+	GetCacheFile(ini, cachefile);
+	_snprintf(tmpfile, MAX_PATH, "%s.%d", cachefile, GetCurrentProcessId());
+	tmpfile[MAX_PATH - 1] = 0;
+	bool ok = false;
+	HANDLE h = CreateFile(tmpfile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(h != INVALID_HANDLE_VALUE) {
+		DWORD written = 0, size = count * sizeof(VMRuntime);
+		ok = WriteFile(h, &hdr, sizeof(hdr), &written, NULL) && written == sizeof(hdr);
+		ok = ok && (size == 0 || WriteFile(h, runtimes, size, &written, NULL) && written == size);
+		CloseHandle(h);
+		if(ok)
+			ok = MoveFileEx(tmpfile, cachefile, MOVEFILE_REPLACE_EXISTING) != 0;
+		if(!ok)
+			DeleteFile(tmpfile);
+	}
+	if(!ok)
+		Log::Warning("Could not write VM cache: %s", cachefile);
+}
+
+VMRuntime* VMDiscovery::FindRuntimes(dictionary* ini, int& count, bool& cached, bool refresh)
+{
+	bool useCache = iniparser_getboolean(ini, VM_CACHE, 0) != 0;
+	ULONGLONG stamp = useCache ? GetStamp(ini) : 0;
+	cached = false;
+	if(useCache && !refresh) {
+		VMRuntime* runtimes = LoadCache(ini, stamp, count);
+		if(runtimes) {
+			Log::Info("VM runtimes loaded from cache: %d", count);
+			cached = true;
+			return runtimes;
+		}
+	}
+
+	VMRuntimeList list = { NULL, 0, 0 };
+	const char* providers = iniparser_getstring(ini, VM_DISCOVERY, "registry");
+	for(const char* p = providers; *p; ) {
+		int len = strcspn(p, ", ");
+		VMProvider* provider = GetProvider(p, len);
+		if(provider)
+			provider->Discover(ini, &list);
+		else if(len)
+			Log::Warning("Unknown vm.discovery provider: %.*s", len, p);
+		p += len;
+		p += strspn(p, ", ");
+	}
+	for(int i = 0; i < list.count; i++)
+		Log::Info("Found VM %s (%s): %s", list.runtimes[i].version, list.runtimes[i].vendor, list.runtimes[i].library);
+
+	if(useCache)
+		SaveCache(ini, stamp, list.runtimes, list.count);
+	count = list.count;
+	return list.runtimes;
+}
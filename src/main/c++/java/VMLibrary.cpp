@@ -0,0 +1,87 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#include "java/VMLibrary.h"
+#include <stdio.h>
+#include <string.h>
+
+// We need to load an MS runtime library before the VM otherwise bad things
+// happen so we assume the VM is located under a bin path and inside this bin
+// dir there is the dll
+void VMLibrary::Prepare(const char* libPath)
+{
+	int len = strlen(libPath);
+	TCHAR binPath[MAX_PATH];
+	strcpy(binPath, libPath);
+
+	// strip off "client\jvm.dll" or "server\jvm.dll"
+	int i, sc=0;
+	for(i = len - 1; i >=0; i--) {
+		if(binPath[i] == '\\') {
+			binPath[i] = 0;
+			sc++;
+			if(sc>1)
+				break;
+		}
+	}
+
+	// Append library path and load - we have a couple of choices here depending on 
+	// VM version - we don't treat failure here as an error as some VM versions
+	// don't have this runtime installed
+	strcat(binPath, "\\msvcr71.dll");
+	if(!LoadLibrary(binPath)) {
+		binPath[i] = 0;
+		strcat(binPath, "\\msvcrt.dll");
+		if(!LoadLibrary(binPath)) {
+			binPath[i] = 0;
+			strcat(binPath, "\\msvcr100.dll");
+			if(!LoadLibrary(binPath)) {
+				// Now resort to using SetDllDirectory - must use dynamic binding as 
+				// this function is not available on all versions of windows
+				typedef BOOL (WINAPI *LPFNSetDllDirectory)(LPCTSTR lpPathname);
+				HINSTANCE hKernel32 = GetModuleHandle("kernel32");
+				LPFNSetDllDirectory lpfnSetDllDirectory = (LPFNSetDllDirectory)GetProcAddress(hKernel32, "SetDllDirectoryA");
+				if (lpfnSetDllDirectory != NULL) {
+					binPath[i] = 0;
+					lpfnSetDllDirectory(binPath);
+				}
+			}
+		}
+	}
+}
+
+void* VMLibrary::Load(const char* libPath)
+{
+	return LoadLibrary(libPath);
+}
+
+void* VMLibrary::GetSymbol(void* library, const char* name)
+{
+	return (void*) GetProcAddress((HMODULE) library, name);
+}
+
+void VMLibrary::Free(void* library)
+{
+	if(library)
+		FreeLibrary((HMODULE) library);
+}
+
+void VMLibrary::GetError(char* msg, int size)
+{
+	DWORD error = GetLastError();
+	if(!FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, NULL, error, 0, msg, size, NULL))
+		_snprintf(msg, size, "error %d", error);
+	msg[size - 1] = 0;
+
+	// Drop the line break FormatMessage ends with
+	int len = strlen(msg);
+	while(len > 0 && (msg[len - 1] == '\r' || msg[len - 1] == '\n'))
+		msg[--len] = 0;
+}
@@ -0,0 +1,186 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#include "launcher/Placement.h"
+#include "common/Log.h"
+
+#define MAX_GROUP_CPUS (sizeof(DWORD_PTR) * 8)
+
+// GetNumaNodeProcessorMaskEx arrived in Windows 7 so is bound dynamically
+typedef struct {
+	ULONGLONG Mask;
+	WORD Group;
+	WORD Reserved[3];
+} NodeGroupAffinity;
+
+typedef BOOL (WINAPI *LPFNGetNumaNodeProcessorMaskEx)(USHORT node, NodeGroupAffinity* affinity);
+typedef BOOL (WINAPI *LPFNGetProcessGroupAffinity)(HANDLE hProcess, PUSHORT groupCount, PUSHORT groups);
+
+namespace
+{
+	bool g_numaNode = false;
+	bool g_numaInterleave = false;
+}
+
+// Parses "0-3,8,10-11" or a mask such as "0xf0f"
+bool Placement::ParseCpuList(LPCSTR list, ULONGLONG& mask)
+{
+	mask = 0;
+	if(_strnicmp(list, "0x", 2) == 0) {
+		char* end;
+		mask = _strtoui64(list + 2, &end, 16);
+		return *end == 0 && mask != 0;
+	}
+
+	const char* p = list;
+	while(*p) {
+		char* end;
+		unsigned long first = strtoul(p, &end, 10);
+		if(end == p)
+			return false;
+		unsigned long last = first;
+		p = end;
+		if(*p == '-') {
+			last = strtoul(++p, &end, 10);
+			if(end == p || last < first)
+				return false;
+			p = end;
+		}
+		if(last >= MAX_GROUP_CPUS) {
+			Log::Warning("Processor %lu is outside the processor group", last);
+			return false;
+		}
+		for(unsigned long cpu = first; cpu <= last; cpu++)
+			mask |= 1ULL << cpu;
+		while(*p == ' ')
+			p++;
+		if(*p == ',')
+			p++;
+		else if(*p)
+			return false;
+	}
+	return mask != 0;
+}
+
+bool Placement::GetNodeMask(int node, ULONGLONG& mask)
+{
+	ULONG highest = 0;
+	if(!GetNumaHighestNodeNumber(&highest) || node < 0 || (ULONG) node > highest) {
+		Log::Warning("NUMA node %d does not exist, the highest is %d", node, highest);
+		return false;
+	}
+
+	// A node in another processor group than the process cannot be used, as
+	// the VM's threads start out in the process's group
+	HMODULE hKernel32 = GetModuleHandle("kernel32");
+	LPFNGetNumaNodeProcessorMaskEx lpfnGetNumaNodeProcessorMaskEx = (LPFNGetNumaNodeProcessorMaskEx)
+		GetProcAddress(hKernel32, "GetNumaNodeProcessorMaskEx");
+	LPFNGetProcessGroupAffinity lpfnGetProcessGroupAffinity = (LPFNGetProcessGroupAffinity)
+		GetProcAddress(hKernel32, "GetProcessGroupAffinity");
+	if(lpfnGetNumaNodeProcessorMaskEx && lpfnGetProcessGroupAffinity) {
+		NodeGroupAffinity affinity;
+		USHORT groups[4];
+		USHORT groupCount = 4;
+		if(lpfnGetNumaNodeProcessorMaskEx((USHORT) node, &affinity) &&
+			lpfnGetProcessGroupAffinity(GetCurrentProcess(), &groupCount, groups) && groupCount > 0) {
+			if(affinity.Group != groups[0]) {
+				Log::Warning("NUMA node %d is in processor group %d, the process is in group %d",
+					node, affinity.Group, groups[0]);
+				return false;
+			}
+			mask = affinity.Mask;
+			return mask != 0;
+		}
+	}
+
+	return GetNumaNodeProcessorMask((UCHAR) node, &mask) && mask != 0;
+}
+
+void Placement::Apply(dictionary* ini)
+{
+	char* cpus = iniparser_getstr(ini, PROCESS_CPU_AFFINITY);
+	char* node = iniparser_getstr(ini, PROCESS_NUMA_NODE);
+	g_numaInterleave = iniparser_getboolean(ini, PROCESS_NUMA_INTERLEAVE, 0) != 0;
+	if(!cpus && !node) {
+		if(g_numaInterleave)
+			Log::Info("Interleaving the VM heap across NUMA nodes");
+		return;
+	}
+
+	ULONGLONG mask = 0;
+	if(cpus && !ParseCpuList(cpus, mask)) {
+		Log::Warning("Invalid process CPU affinity: %s", cpus);
+		mask = 0;
+	}
+
+	// A node that does not parse is ignored rather than taken as node 0
+	int nodeNumber = -1;
+	if(node) {
+		char* end;
+		long value = strtol(node, &end, 10);
+		if(end == node || *end != 0 || value < 0 || value > MAXWORD) {
+			Log::Warning("Invalid process NUMA node: %s", node);
+			node = NULL;
+		} else {
+			nodeNumber = (int) value;
+		}
+	}
+	ULONGLONG nodeMask = 0;
+	if(node && GetNodeMask(nodeNumber, nodeMask)) {
+		g_numaNode = true;
+		if(mask == 0) {
+			mask = nodeMask;
+		} else if((mask & nodeMask) == 0) {
+			Log::Warning("Process CPU affinity %s has no processors on NUMA node %d, using the node", cpus, nodeNumber);
+			mask = nodeMask;
+		} else {
+			mask &= nodeMask;
+		}
+	}
+	if(g_numaNode && g_numaInterleave) {
+		Log::Warning("Ignoring process.numa.interleave as the process is pinned to NUMA node %d", nodeNumber);
+		g_numaInterleave = false;
+	}
+	if(mask == 0)
+		return;
+
+	// Only processors in the system mask can be used
+	DWORD_PTR processMask, systemMask;
+	if(GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+		mask &= systemMask;
+	if(mask == 0 || !SetProcessAffinityMask(GetCurrentProcess(), (DWORD_PTR) mask)) {
+		Log::Warning("Could not set process affinity: 0x%I64x", mask);
+		return;
+	}
+
+	GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask);
+	if(g_numaNode)
+		Log::Info("Process affinity: 0x%I64x (NUMA node %d)", (ULONGLONG) processMask, nodeNumber);
+	else
+		Log::Info("Process affinity: 0x%I64x", (ULONGLONG) processMask);
+}
+
+void Placement::AddArgs(TCHAR** args, UINT& count)
+{
+	bool chosen = false;
+	for(UINT i = 0; i < count; i++) {
+		if(StartsWith(args[i], "-XX:+UseNUMA") || StartsWith(args[i], "-XX:-UseNUMA"))
+			chosen = true;
+	}
+	if(chosen)
+		return;
+
+	// Windows has no interleaving policy for a process, but the VM can
+	// interleave its heap across the nodes itself
+	if(g_numaNode)
+		args[count++] = _strdup("-XX:+UseNUMA");
+	else if(g_numaInterleave)
+		args[count++] = _strdup("-XX:+UseNUMAInterleaving");
+}
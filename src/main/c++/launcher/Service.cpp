@@ -117,6 +117,8 @@ int Service::Initialise(dictionary* ini)
 	// Parse controls accepted
 	char* controls = iniparser_getstr(ini, SERVICE_CONTROLS);
 	if(controls) {
+		// Split a copy as the value belongs to the INI
+		controls = _strdup(controls);
 		int len = strlen(controls);
 		int nb = 0;
 		for(int i = 0; i < len; i++) {
@@ -151,6 +153,7 @@ int Service::Initialise(dictionary* ini)
 			p += plen + 1;
 			if(p >= e) break;
 		}
+		free(controls);
 	} else {
 		g_controlsAccepted = SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_SHUTDOWN;
 	}
@@ -162,9 +165,10 @@ int Service::Initialise(dictionary* ini)
 		return 1;
 	}
 
-	char* svcClass = iniparser_getstr(ini, SERVICE_CLASS);
+	char* svcClass = _strdup(iniparser_getstring(ini, SERVICE_CLASS, ""));
 	StrReplace(svcClass, '.', '/');
 	g_serviceClass = JNI::FindClass(env, svcClass);
+	free(svcClass);
 	if(g_serviceClass == NULL) {
 		Log::Error("Could not find service class");
 		return 1;
@@ -269,9 +273,8 @@ int Service::Register(dictionary* ini)
 	}
 
 	// Check for dependencies
-	TCHAR* dependencies[MAX_PATH];
 	UINT depCount = 0;
-	INI::GetNumberedKeysFromIni(ini, SERVICE_DEPENDENCY, dependencies, depCount);
+	TCHAR** dependencies = INI::GetNumberedKeysFromIni(ini, SERVICE_DEPENDENCY, depCount);
 	
 	// Make dependency list
 	TCHAR* depList = NULL;
@@ -410,9 +413,8 @@ int Service::Main(int argc, char* argv[])
 	JNIEnv* env = VM::GetJNIEnv();
 
 	// Grab any config args
-	TCHAR *progargs[MAX_PATH];
 	UINT progargsCount = 0;
-	INI::GetNumberedKeysFromIni(g_ini, PROG_ARG, progargs, progargsCount);
+	TCHAR** progargs = INI::GetNumberedKeysFromIni(g_ini, PROG_ARG, progargsCount);
 
 	// Create the run args
 	jclass stringClass = env->FindClass("java/lang/String");
@@ -21,9 +21,12 @@
 #include "common/Log.h"
 #include "common/INI.h"
 #include "common/Dictionary.h"
+#include "common/Profile.h"
 #include "java\JNI.h"
 #include "java\VM.h"
 #include "java\Classpath.h"
+#include "java\CDS.h"
+#include "java\Prefetch.h"
 
 class WinRun4J
 {
@@ -14,24 +14,99 @@ iniparser is distributed under an MIT license.
 #include <stdio.h>
 #include <ctype.h>
 
+typedef struct _dictionary_block_ {
+	struct _dictionary_block_ * next ;	/** Next (older) block */
+	int				size ;	/** Usable bytes in block */
+	int				used ;	/** Bytes handed out so far */
+} dictionary_block ;
+
+typedef struct _dictionary_section_ {
+	char		 *	name ;	/** Section name (without the colon) */
+	int				len ;	/** Length of name */
+	unsigned		hash ;	/** Hash of name */
+	int				slot ;	/** Slot of the [section] entry, -1 if none */
+	int				first ;	/** First slot in the section */
+	int				last ;	/** Last slot in the section */
+} dictionary_section ;
+
+typedef struct _dictionary_list_ {
+	char		 *	name ;	/** Key without the trailing .N */
+	int				len ;	/** Length of name */
+	unsigned		hash ;	/** Hash of name */
+	int				n ;		/** Number of entries in list */
+	int				size ;	/** Storage size */
+	int			 *	num ;	/** Entry numbers (sorted) */
+	int			 *	slot ;	/** Slot of each entry */
+} dictionary_list ;
+
+/* Slot flags */
+#define DICT_EXPAND		0x01	/* Value still holds unexpanded variables */
+#define DICT_EXPANDING	0x02	/* Value is being expanded */
+
+/* Parsed forms of a value held in dictionary_value.have */
+#define DICT_INT		0x01
+#define DICT_DOUBLE		0x02
+#define DICT_BOOL		0x04
+
+typedef struct _dictionary_value_ {
+	volatile long	have ;	/** DICT_INT/DOUBLE/BOOL set once the field is valid */
+	int				i ;		/** Value as read by getint */
+	int				b ;		/** Value as read by getboolean, -1 if not a boolean */
+	double			f ;		/** Value as read by getdouble */
+} dictionary_value ;
+
 typedef struct _dictionary_ {
 	int				n ;		/** Number of entries in dictionary */
 	int				size ;	/** Storage size */
 	char 		**	val ;	/** List of string values */
 	char 		**  key ;	/** List of string keys */
 	unsigned	 *	hash ;	/** List of hash values for keys */
+	int				last ;	/** One past the highest slot in use */
+	int			 *	index ;	/** Open addressed hash index of slots */
+	int				isize ;	/** Index size (power of two) */
+	int				arena ;	/** Strings are owned by the block list below */
+	dictionary_block * blocks ;	/** Arena blocks (newest first) */
+	int			 *	secid ;	/** Section of each slot */
+	int			 *	snext ;	/** Next slot in the same section, -1 ends */
+	int			 *	sprev ;	/** Previous slot in the same section, -1 ends */
+	int				nsec ;	/** Number of sections */
+	int				secsize ;	/** Section storage size */
+	int				seccur ;	/** Section of the most recent insert */
+	dictionary_section * sec ;	/** Sections in order of first appearance */
+	int				nlist ;	/** Number of numbered key lists */
+	int				listsize ;	/** List storage size */
+	dictionary_list * list ;	/** Lists of name.N keys */
+	int			 *	lindex ;	/** Open addressed hash index of lists */
+	int				lisize ;	/** List index size (power of two) */
+	unsigned char *	flags ;	/** DICT_ flags of each slot */
+	dictionary_value * typed ;	/** Parsed value of each slot */
+	char *	(*expand)(struct _dictionary_ * d, int slot) ;	/** Expands DICT_EXPAND values on first read (slot -1 releases) */
+	void		 *	expandctx ;	/** State owned by expand */
 } dictionary ;
 
 // Dictionary 
 
-unsigned dictionary_hash(char * key);
-dictionary * dictionary_new(int size);
+unsigned dictionary_hash(const char * key);
+unsigned dictionary_hashn(const char * key, int len);
+dictionary * dictionary_new(int size, bool arena = false);
 void dictionary_del(dictionary * vd);
 char * dictionary_get(dictionary * d, char * key, char * def);
 char dictionary_getchar(dictionary * d, char * key, char def) ;
 int dictionary_getint(dictionary * d, char * key, int def);
 double dictionary_getdouble(dictionary * d, char * key, double def);
+int dictionary_lookup(dictionary * d, const char * key, int len, unsigned hash);
+int dictionary_lookupsec(dictionary * d, const char * sec, const char * key);
+dictionary_list * dictionary_getlist(dictionary * d, const char * key);
+char * dictionary_getval(dictionary * d, int slot);
+int dictionary_getvalint(dictionary * d, int slot);
+double dictionary_getvaldouble(dictionary * d, int slot);
+int dictionary_getvalbool(dictionary * d, int slot);
 void dictionary_set(dictionary * vd, char * key, char * val);
+void dictionary_setn(dictionary * d, const char * key, int keylen, const char * val, int vallen);
+void dictionary_setref(dictionary * d, char * key, int keylen, char * val);
+char * dictionary_alloc(dictionary * d, int len);
+void dictionary_merge(dictionary * d, dictionary * src);
+dictionary * dictionary_copy(dictionary * d);
 void dictionary_unset(dictionary * d, char * key);
 void dictionary_setint(dictionary * d, char * key, int val);
 void dictionary_setdouble(dictionary * d, char * key, double val);
@@ -45,6 +120,8 @@ void iniparser_dump_ini(dictionary * d, FILE * f);
 void iniparser_dump(dictionary * d, FILE * f);
 char * iniparser_getstr(dictionary * d, const char * key);
 char * iniparser_getstring(dictionary * d, const char * key, char * def);
+char * iniparser_getsecstring(dictionary * d, const char * sec, const char * key, char * def, int fallback);
+int iniparser_findsec(dictionary * d, const char * sec, const char * key, int fallback);
 int iniparser_getint(dictionary * d, const char * key, int notfound);
 double iniparser_getdouble(dictionary * d, char * key, double notfound);
 int iniparser_getboolean(dictionary * d, const char * key, int notfound);
@@ -61,6 +138,5 @@ char * strupc(char * s);
 char * strskp(char * s);
 char * strcrop(char * s);
 char * strstrip(char * s) ;
-char * sgets(char* buffer, int* pos, char * line, int size) ;
 
 #endif // DICTIONARY_H
@@ -0,0 +1,39 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include "common/Runtime.h"
+
+struct DirEntry {
+	char* name;
+	bool isDir;
+	bool isLink;   // junction or symbolic link
+};
+
+// File system access used when expanding classpath wildcards
+struct Directory {
+	// Lists the entries of dir matching pattern (FindFirstFile wildcards) in the
+	// order the file system returns them, without "." and "..". Returns the
+	// number of entries, entries must be released with Free.
+	static int List(const char* dir, const char* pattern, DirEntry** entries);
+	static void Free(DirEntry* entries, int count);
+	static bool Exists(const char* path);
+
+	// True if dir has no entries other than "." and ".." (stops at the first)
+	static bool IsEmpty(const char* dir);
+
+	// Last write time of path, or 0 if it does not exist. A directory's time
+	// changes when entries are added, removed or renamed.
+	static ULONGLONG GetWriteTime(const char* path);
+};
+
+#endif // DIRECTORY_H
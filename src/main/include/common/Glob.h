@@ -0,0 +1,56 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#ifndef GLOB_H
+#define GLOB_H
+
+#include "common/Runtime.h"
+
+#define GLOB_LITERAL 0  // component without wildcards
+#define GLOB_MATCH   1  // component with *, ? or [...]
+#define GLOB_ANYDIRS 2  // ** matching any number of directories
+
+// Makes the next character literal, so "lib`[1]" is the directory lib[1].
+// A backtick rather than '\' as that is the path separator on Windows.
+#define GLOB_ESCAPE '`'
+
+typedef struct {
+	BYTE op;
+	BYTE c;          // lower case character
+	BYTE set[32];    // characters of a class, both cases
+} GlobToken;
+
+typedef struct {
+	int type;
+	char* text;      // without escapes
+	GlobToken* tokens;
+	int tokenCount;
+} GlobPart;
+
+// A path pattern split at the first component with a wildcard. Matching is
+// case insensitive and treats '/' and '\' alike.
+typedef struct {
+	char* base;       // leading components without wildcards, unescaped
+	GlobPart* parts;  // remaining components
+	int partCount;
+} GlobPattern;
+
+struct Glob {
+	static GlobPattern* Compile(const char* pattern);
+	static void Free(GlobPattern* glob);
+
+	// Matches a single file name against one component
+	static bool MatchPart(GlobPart* part, const char* name);
+
+	// Matches a whole path, which must start with the base
+	static bool Match(GlobPattern* glob, const char* path);
+};
+
+#endif // GLOB_H
@@ -32,14 +32,21 @@
 #define SERVICE_CLASS ":service.class"
 #define SERVICE_MODE  ":service.mode"
 
+struct Expansion;
+
 class INI
 {
 public:
-	static void GetNumberedKeysFromIni(dictionary* ini, TCHAR* keyName, TCHAR** entries, UINT& index, UINT max = 10);
+	static TCHAR** GetNumberedKeysFromIni(dictionary* ini, TCHAR* keyName, UINT& count, UINT reserve = 0);
 	static UINT GetNumberedKeysMax(dictionary* ini, TCHAR* keyName);
 	static void SetNumberedKeys(dictionary* ini, TCHAR* keyName, TCHAR** entries, UINT count); 
 	static dictionary* LoadIniFile(HINSTANCE hInstance);
 	static dictionary* LoadIniFile(HINSTANCE hInstance, LPSTR inifile);
+	static HKEY GetHKey(char* key);
+	static void ExpandAll(dictionary* ini);
+	static void SetEnvironment(dictionary* ini, LPCSTR name, LPCSTR value);
+	static void Publish(dictionary* ini);
+	static dictionary* GetPublished();
 
 	static char* GetString(dictionary* ini, const TCHAR* section, const TCHAR* key, TCHAR* defValue, bool defFromMainSection = true);
 	static int   GetInteger(dictionary* ini, const TCHAR* section, const TCHAR* key, int defValue, bool defFromMainSection = true);
@@ -48,11 +55,14 @@ public:
 private:
 	static bool StrTrimInChars(LPSTR trimChars, char c);
 	static void StrTrim(LPSTR str, LPSTR trimChars);
-	static void ExpandVariables(dictionary* ini);
-	static void ExpandRegistryVariables(dictionary* ini);
-	static int GetRegistryValue(char* input, char* output, int len);
+	static void ExpandVariables(dictionary* ini, dictionary* parent = NULL, bool lazy = false);
+	static char* ExpandSlot(dictionary* ini, int slot);
+	static char* ExpandValue(Expansion* e, int slot);
+	static const char* ExpandReference(Expansion* e, const char* name, int len);
+	static const char* ExpandLookup(Expansion* e, char kind, const char* name, int len);
+	static char* GetRegistryValue(const char* input);
 	static void ParseRegistryKeys(dictionary* ini);
-	static HKEY GetHKey(char* key);
+	static dictionary* LoadIniKeys(HINSTANCE hInstance, LPSTR inifile);
 };
 
 #endif // INI_H
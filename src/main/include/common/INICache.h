@@ -0,0 +1,39 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#ifndef INI_CACHE_H
+#define INI_CACHE_H
+
+#include "common/Runtime.h"
+#include "common/Dictionary.h"
+
+#define INI_CACHE ":ini.cache"
+
+// Snapshot of the merged and expanded INI keys, stored next to the INI file
+// and keyed on everything that went into building them (files, registry keys
+// and environment variables).
+struct INICache {
+	// Record the inputs of the current load
+	static void Reset();
+	static void AddFile(LPCSTR filename);
+	static void AddRegistryKey(LPCSTR location, REGSAM sam);
+	static void AddEnvironment(LPCSTR name, int len);
+
+	static dictionary* Load(LPCSTR inifile, bool& stale);
+	static bool Save(dictionary* ini, LPCSTR inifile);
+	static void Delete(LPCSTR inifile);
+
+private:
+	static void GetCacheFile(LPCSTR inifile, LPSTR cachefile);
+	static void AddInput(DWORD type, LPCSTR name, int len, ULONGLONG stamp, ULONGLONG size);
+	static bool GetStamp(DWORD type, LPCSTR name, ULONGLONG& stamp, ULONGLONG& size);
+};
+
+#endif // INI_CACHE_H
@@ -0,0 +1,68 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "common/Runtime.h"
+#include "common/Dictionary.h"
+
+// Writes the startup profile as JSON to this file
+#define STARTUP_PROFILE ":startup.profile"
+
+// Set by --WinRun4J:StartupProfile for the launches it makes, which write
+// their profile here and stop once the main class is found
+#define STARTUP_PROFILE_ENV "WINRUN4J_STARTUP_PROFILE"
+
+enum ProfilePhase {
+	PROFILE_COMMAND_LINE,
+	PROFILE_INI,
+	PROFILE_INI_CACHE,
+	PROFILE_INI_PARSE,
+	PROFILE_INI_MERGE,
+	PROFILE_INI_ENV,
+	PROFILE_INI_REGISTRY,
+	PROFILE_CLASSPATH,
+	PROFILE_VM_FIND,
+	PROFILE_VM_RUNTIME,
+	PROFILE_VM_LOAD,
+	PROFILE_VM_WAIT,
+	PROFILE_VM_CREATE,
+	PROFILE_JNI_INIT,
+	PROFILE_CLASSLOADER,
+	PROFILE_MAIN_CLASS,
+	PROFILE_PHASES
+};
+
+// Times the phases of a launch with the performance counter. Time spent in
+// a phase is added up over every call, so ini.env and ini.registry include
+// the lookups made while other phases read the INI. vm.runtime and vm.load
+// overlap the classpath phases when the VM library is preloaded, vm.wait is
+// the time startup then spent waiting for it.
+struct Profile {
+	static void Init();
+	static LONGLONG Start();
+	static void End(ProfilePhase phase, LONGLONG start);
+	static double ToMillis(LONGLONG ticks);
+
+	// Logs the profile (and writes it as JSON if asked) at the end of startup.
+	// Returns true if this is a profiling launch that should stop here.
+	static bool Report(dictionary* ini);
+
+	// Launches this module runs times with args and prints percentiles of
+	// each phase
+	static int Run(int runs, TCHAR** args, UINT argCount);
+
+private:
+	static bool WriteJSON(LPCSTR file, LONGLONG total);
+	static bool ReadJSON(LPCSTR file, double* times);
+};
+
+#endif // PROFILE_H
@@ -0,0 +1,32 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#ifndef CDS_H
+#define CDS_H
+
+#include "common/Runtime.h"
+#include "common/INI.h"
+
+#define VM_CDS     ":vm.cds"
+#define VM_CDS_DIR ":vm.cds.dir"
+#define CDS_MAX_ARGS 2  // args AddArgs adds at most
+
+// Class data sharing archives of the application classes. With vm.cds=auto
+// an archive is kept for each classpath and VM, named by a hash of the two,
+// and is created by the first launch that does not find it.
+struct CDS {
+	static void AddArgs(dictionary* ini, LPSTR vmlibrary, TCHAR** args, UINT& count);
+
+private:
+	static int GetJavaVersion(LPSTR vmlibrary, LPSTR version, int size);
+	static void RemoveStale(LPCSTR dir, LPCSTR name, LPCSTR archive);
+};
+
+#endif // CDS_H
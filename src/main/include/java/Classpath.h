@@ -14,8 +14,10 @@
 #include "common/Runtime.h"
 #include "common/INI.h"
 
-#define CLASS_PATH     ":classpath"
-#define CLASS_PATH_ARG "-Djava.class.path="
+#define CLASS_PATH         ":classpath"
+#define CLASS_PATH_EXCLUDE ":classpath.exclude"
+#define CLASS_PATH_ARG     "-Djava.class.path="
+#define CLASS_PATH_MAX_ARGS 1  // args BuildClassPath adds
 
 struct Classpath {
 	static void BuildClassPath(dictionary *ini, TCHAR** args, UINT& count);
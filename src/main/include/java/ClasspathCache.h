@@ -0,0 +1,35 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#ifndef CLASSPATH_CACHE_H
+#define CLASSPATH_CACHE_H
+
+#include "common/Runtime.h"
+#include "common/Directory.h"
+
+#define CLASSPATH_CACHE ":classpath.cache"
+
+// Directory listings walked while expanding classpath wildcards, stored next
+// to the INI file with the write time of each directory. A listing is reused
+// for as long as its directory is unchanged.
+struct ClasspathCache {
+	// Loads the cache of inifile, or only tracks listings when inifile is NULL
+	static void Load(LPCSTR inifile);
+
+	// Lists dir for pattern (as Directory::List), the entries belong to the
+	// cache. May be called from several threads.
+	static int List(const char* dir, const char* pattern, DirEntry** entries);
+
+	// Reports hits and misses and writes back the listings used by this launch
+	static bool Save();
+	static void Free();
+};
+
+#endif // CLASSPATH_CACHE_H
@@ -0,0 +1,33 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#ifndef LARGE_PAGES_H
+#define LARGE_PAGES_H
+
+#include "common/Runtime.h"
+#include "common/INI.h"
+#include "java/VMBudget.h"
+
+#define VM_LARGE_PAGES ":vm.large.pages"  // auto, require or off (default off)
+#define LARGE_PAGES_MAX_ARGS 2             // args AddArgs adds at most
+
+// Gives the VM a heap of large pages when the host can back it. With auto
+// the VM falls back to normal pages, with require the launch fails instead
+// of the VM quietly falling back itself.
+struct LargePages {
+	// Returns false if large pages are required but cannot be had
+	static bool AddArgs(dictionary* ini, VMResources* budget, TCHAR** args, UINT& count);
+
+private:
+	static ULONGLONG GetHeapSize(VMResources* budget, TCHAR** args, UINT count);
+	static bool EnableLockMemoryPrivilege();
+};
+
+#endif // LARGE_PAGES_H
@@ -0,0 +1,46 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include "common/Runtime.h"
+#include "common/INI.h"
+
+#define VM_PREFETCH     ":vm.prefetch"      // read ahead the VM and classpath files (default false)
+#define VM_PREFETCH_MAX ":vm.prefetch.max"  // megabytes to read ahead (default 512)
+
+typedef struct {
+	char path[MAX_PATH];
+	ULONGLONG size;
+} PrefetchFile;
+
+// Reads the VM library, the runtime's modules image (rt.jar before Java 9)
+// and the classpath jars into the file cache on a thread of its own, so that
+// a cold launch finds them there rather than faulting them in one page at a
+// time. The runtime is read as soon as it is found and the jars once the
+// classpath is built, the largest files of each first.
+struct Prefetch {
+	static void Start(dictionary* ini, LPSTR vmlibrary);
+
+	// Queues the classpath jars, after which no more files are added
+	static void AddClasspath(TCHAR** args, UINT count);
+
+	// Logs what has been read so far
+	static void Report();
+
+private:
+	static void AddFile(LPCSTR path);
+	static void Queue(int first, bool last);
+	static ULONGLONG ReadAhead(LPCSTR path, ULONGLONG size);
+	static DWORD WINAPI PrefetchThreadProc(LPVOID param);
+};
+
+#endif // PREFETCH_H
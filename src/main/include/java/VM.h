@@ -14,6 +14,9 @@
 #include "common/Runtime.h"
 #include <jni.h>
 #include "common/INI.h"
+#include "java/VMDiscovery.h"
+#include "java/VMBudget.h"
+#include "java/LargePages.h"
 #include <string.h>
 
 
@@ -33,10 +36,17 @@
 // General VM keys
 #define VM_LOCATION ":vm.location"
 #define VM_SYSFIRST ":vm.sysfirst"
+#define VM_PRELOAD  ":vm.preload"   // load the VM library while the classpath is built (default true)
 
 // VM args
 #define VM_ARG_HEAPSIZE "-Xmx"
 
+// Args the launcher adds at most: -Xmx (preferred or percent) and -Xms, then
+// those of the budget and large pages, and -Djava.library.path separately
+#define VM_HEAP_MAX_ARGS         2
+#define VM_SPECIFIC_MAX_ARGS     (VM_HEAP_MAX_ARGS + VM_BUDGET_MAX_ARGS + LARGE_PAGES_MAX_ARGS)
+#define VM_LIBRARY_PATH_MAX_ARGS 1
+
 // Encapsulates a VM version number
 class Version {
 public:
@@ -44,22 +54,25 @@ public:
 	void Parse(LPSTR version);
 	int Compare(Version& other);
 	char* GetVersionStr() { return VersionStr; }
-	char* GetRegPath() { return RegPath; }
-	void SetRegPath(char *regPath) { strcpy(RegPath, regPath); }
 
 private:
 	bool Parsed;
 	char VersionStr[MAX_PATH];
 	int VersionPart[10];
-	char RegPath[MAX_PATH];
 };
 
 // VM utilities
 struct VM {
 	static char* FindJavaVMLibrary(dictionary *ini);
-	static void ExtractSpecificVMArgs(dictionary* ini, TCHAR** args, UINT& count);
-	static char* GetJavaVMLibrary(LPSTR version, LPSTR min, LPSTR max);
-	static void LoadRuntimeLibrary(TCHAR* libPath);
+	// Returns false if the VM cannot be given what the INI requires
+	static bool ExtractSpecificVMArgs(dictionary* ini, TCHAR** args, UINT& count);
+	// Adds java.library.path.N to the args and the PATH
+	static void SetLibraryPath(dictionary* ini, TCHAR** args, UINT& count);
+	static char* GetJavaVMLibrary(dictionary* ini, LPSTR version, LPSTR min, LPSTR max);
+	// Starts loading the VM library on a background thread, which
+	// StartJavaVM waits for. The PATH must be set up first.
+	static void PreloadJavaVM(dictionary* ini, TCHAR* libPath);
+	static void WaitForPreload();
 	static int StartJavaVM(TCHAR* libPath, TCHAR* vmArgs[], HINSTANCE hInstance);
 	static int CleanupVM();
 	static JavaVM* GetJavaVM();
@@ -69,8 +82,7 @@ struct VM {
 	static void ExitHook(int status);
 	
 public:
-	static Version* FindVersion(Version* versions, DWORD numVersions, LPSTR version, LPSTR min, LPSTR max);
-	static void FindVersions(Version* versions, DWORD* numVersions);
+	static VMRuntime* FindVersion(VMRuntime* runtimes, int count, LPSTR version, LPSTR min, LPSTR max);
 };
 
 #endif // VM_UTILS_H
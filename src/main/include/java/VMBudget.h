@@ -0,0 +1,44 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#ifndef VM_BUDGET_H
+#define VM_BUDGET_H
+
+#include "common/Runtime.h"
+#include "common/INI.h"
+
+#define VM_BUDGET_MEMORY ":vm.budget.memory"  // megabytes the VM may use
+#define VM_BUDGET_CPUS   ":vm.budget.cpus"    // processors the VM may use
+#define VM_BUDGET_MAX_ARGS 3                   // args AddArgs adds at most
+
+// The memory and processors the VM can actually use, which are less than
+// the machine has when the launcher runs in a job object (a container or a
+// service host with limits) or the INI file says so
+typedef struct {
+	ULONGLONG memory;        // megabytes
+	int cpus;
+	bool memoryLimited;      // less than the physical memory
+	bool cpusLimited;        // fewer than the machine's processors
+	const char* memorySource;
+	const char* cpuSource;
+} VMResources;
+
+struct VMBudget {
+	static void Get(dictionary* ini, VMResources* budget);
+
+	// Adds -XX:ActiveProcessorCount and a collector to suit a limited budget,
+	// unless the VM args already choose them
+	static void AddArgs(VMResources* budget, TCHAR** args, UINT& count);
+
+private:
+	static void GetJobLimits(VMResources* budget);
+};
+
+#endif // VM_BUDGET_H
@@ -0,0 +1,68 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#ifndef VM_DISCOVERY_H
+#define VM_DISCOVERY_H
+
+#include "common/Runtime.h"
+#include "common/INI.h"
+
+#define VM_DISCOVERY ":vm.discovery"  // providers to ask, in order (default "registry")
+#define VM_SCAN      ":vm.scan"       // vm.scan.N directories holding runtimes
+#define VM_CACHE     ":vm.cache"
+
+// An installed runtime
+typedef struct {
+	char library[MAX_PATH];   // jvm.dll
+	char version[64];
+	char vendor[64];
+	WORD arch;                // IMAGE_FILE_MACHINE_* of the library, 0 if unknown
+	ULONGLONG stamp;          // last write time of the library
+} VMRuntime;
+
+typedef struct {
+	VMRuntime* runtimes;
+	int count;
+	int size;
+} VMRuntimeList;
+
+// A source of installed runtimes. Stamp folds everything whose change could
+// add or remove a runtime into hash, so that a cached list can be used
+// without asking the provider again.
+typedef struct {
+	const char* name;
+	ULONGLONG (*Stamp)(dictionary* ini, ULONGLONG hash);
+	void (*Discover)(dictionary* ini, VMRuntimeList* list);
+} VMProvider;
+
+struct VMDiscovery {
+	// Finds the runtimes of the providers in vm.discovery, from the cache when
+	// it is enabled and its stamp still holds (unless refresh is set). The
+	// list must be freed by the caller.
+	static VMRuntime* FindRuntimes(dictionary* ini, int& count, bool& cached, bool refresh = false);
+
+	// True if the library has not changed since the runtime was found
+	static bool IsCurrent(VMRuntime* runtime);
+
+	static void AddRuntime(VMRuntimeList* list, LPCSTR library, LPCSTR version, LPCSTR vendor);
+
+	// Reads a value from the release file of the runtime the library belongs to
+	static bool GetReleaseValue(LPCSTR library, LPCSTR key, LPSTR value, int size);
+
+private:
+	static VMProvider* GetProvider(const char* name, int len);
+	static ULONGLONG GetStamp(dictionary* ini);
+	static WORD GetLibraryArch(LPCSTR library);
+	static void GetCacheFile(dictionary* ini, LPSTR cachefile);
+	static VMRuntime* LoadCache(dictionary* ini, ULONGLONG stamp, int& count);
+	static void SaveCache(dictionary* ini, ULONGLONG stamp, VMRuntime* runtimes, int count);
+};
+
+#endif // VM_DISCOVERY_H
@@ -0,0 +1,29 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#ifndef VM_LIBRARY_H
+#define VM_LIBRARY_H
+
+#include "common/Runtime.h"
+
+// Loads the VM's shared library (jvm.dll). StartJavaVM and CleanupVM go
+// through here rather than calling the loader directly.
+struct VMLibrary {
+	// Loads what the library needs before it can be loaded itself
+	static void Prepare(const char* libPath);
+	static void* Load(const char* libPath);
+	static void* GetSymbol(void* library, const char* name);
+	static void Free(void* library);
+
+	// Describes why the last Load or GetSymbol failed
+	static void GetError(char* msg, int size);
+};
+
+#endif // VM_LIBRARY_H
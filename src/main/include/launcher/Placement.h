@@ -0,0 +1,36 @@
+/*******************************************************************************
+ * This program and the accompanying materials
+ * are made available under the terms of the Common Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/cpl-v10.html
+ *
+ * Contributors:
+ *     Peter Smith
+ *******************************************************************************/
+
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include "common/Runtime.h"
+#include "common/Dictionary.h"
+
+#define PROCESS_CPU_AFFINITY    ":process.cpu.affinity"    // processor list (0-3,8) or mask (0xf)
+#define PROCESS_NUMA_NODE       ":process.numa.node"
+#define PROCESS_NUMA_INTERLEAVE ":process.numa.interleave"
+#define PLACEMENT_MAX_ARGS      1  // args AddArgs adds at most
+
+// Places the process on processors and NUMA nodes before the VM is created,
+// so that every VM thread starts out there
+class Placement {
+public:
+	static void Apply(dictionary* ini);
+
+	// Adds the VM's NUMA options to match the placement
+	static void AddArgs(TCHAR** args, UINT& count);
+
+private:
+	static bool ParseCpuList(LPCSTR list, ULONGLONG& mask);
+	static bool GetNodeMask(int node, ULONGLONG& mask);
+};
+
+#endif // PLACEMENT_H